@@ -0,0 +1,232 @@
+#ifndef AFFINITY_HPP
+#define AFFINITY_HPP
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Placement of one pipeline stage: the CPUs its thread may run on, an
+// optional SCHED_FIFO priority, and the NUMA node its memory should come
+// from (derived from the first CPU). An empty CPU list leaves the stage to
+// the scheduler.
+//
+// Stages read their placement from the environment, e.g. for the stage
+// named "match":
+//   MM_CPUS_MATCH=3        pin to CPU 3 (lists such as "2,4-6" also work)
+//   MM_FIFO_MATCH=80       run under SCHED_FIFO with priority 80
+struct StagePlacement {
+  std::vector<int> cpus;
+  int fifo_priority = 0; // 0 keeps the default scheduling policy
+
+  bool pinned() const { return !cpus.empty(); }
+
+  // Parses a Linux-style CPU list ("0-3,8,10-11"). Malformed entries are skipped.
+  static std::vector<int> parseCpuList(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+      try {
+        auto dash = item.find('-');
+        int first = std::stoi(item.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+        for (int cpu = first; cpu <= last; ++cpu) {
+          cpus.push_back(cpu);
+        }
+      } catch (const std::exception&) {
+        std::cerr << "Ignoring malformed CPU list entry: " << item << "\n";
+      }
+    }
+    return cpus;
+  }
+
+  static StagePlacement fromEnv(const std::string& stage) {
+    std::string suffix = stage;
+    std::transform(suffix.begin(), suffix.end(), suffix.begin(), [](unsigned char c) { return std::toupper(c); });
+    StagePlacement placement;
+    if (const char* cpus = std::getenv(("MM_CPUS_" + suffix).c_str())) {
+      placement.cpus = parseCpuList(cpus);
+    }
+    if (const char* fifo = std::getenv(("MM_FIFO_" + suffix).c_str())) {
+      placement.fifo_priority = std::atoi(fifo);
+    }
+    return placement;
+  }
+};
+
+// Placement for the index-th of several identical workers (e.g. matching
+// shards) that should each own a CPU: one CPU from the process's allowed set,
+// counting down from the highest so that the low CPUs stay with the front of
+// the pipeline. Wraps around when there are more workers than CPUs.
+inline StagePlacement spreadPlacement(std::size_t index) {
+  StagePlacement placement;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+    return placement;
+  }
+  std::vector<int> allowed;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &set)) {
+      allowed.push_back(cpu);
+    }
+  }
+  if (!allowed.empty()) {
+    placement.cpus = { allowed[allowed.size() - 1 - index % allowed.size()] };
+  }
+  return placement;
+}
+
+// Returns the NUMA node that owns the CPU, or -1 when unknown.
+inline int numaNodeOfCpu(int cpu) {
+  std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+  DIR* dir = opendir(path.c_str());
+  if (!dir) {
+    return -1;
+  }
+  int node = -1;
+  while (dirent* entry = readdir(dir)) {
+    if (std::strncmp(entry->d_name, "node", 4) == 0 && std::isdigit(static_cast<unsigned char>(entry->d_name[4]))) {
+      node = std::atoi(entry->d_name + 4);
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+inline int numaNodeOf(const StagePlacement& placement) {
+  return placement.pinned() ? numaNodeOfCpu(placement.cpus.front()) : -1;
+}
+
+namespace numa_detail {
+  // From <numaif.h>; spelled out so that libnuma headers are not required.
+  constexpr int kMpolPreferred = 1;
+  constexpr unsigned kMpolMfMove = 1u << 1;
+  constexpr unsigned long kMaxNodes = 64;
+}
+
+// Asks the kernel to back the pages fully inside [addr, addr + len) with
+// memory from node, migrating pages that were already touched. Pages not yet
+// faulted in (e.g. the raw storage of an idle queue) are placed on first touch.
+inline bool bindMemoryToNode(void* addr, std::size_t len, int node) {
+  if (node < 0 || static_cast<unsigned long>(node) >= numa_detail::kMaxNodes) {
+    return false;
+  }
+  auto page = static_cast<std::uintptr_t>(sysconf(_SC_PAGESIZE));
+  auto begin = (reinterpret_cast<std::uintptr_t>(addr) + page - 1) & ~(page - 1);
+  auto end = (reinterpret_cast<std::uintptr_t>(addr) + len) & ~(page - 1);
+  if (end <= begin) {
+    return false;
+  }
+  unsigned long mask = 1ul << node;
+  return syscall(SYS_mbind, begin, end - begin, numa_detail::kMpolPreferred, &mask, numa_detail::kMaxNodes,
+                 numa_detail::kMpolMfMove) == 0;
+}
+
+// Pins the calling thread according to placement, prefers its NUMA node for
+// the thread's future allocations, optionally switches it to SCHED_FIFO, and
+// reports the result on stderr. Unpinned stages are left alone silently.
+// Returns false if any step was refused.
+inline bool applyPlacement(const std::string& stage, const StagePlacement& placement) {
+  if (!placement.pinned()) {
+    return true;
+  }
+  bool ok = true;
+  std::ostringstream report;
+  report << stage << ": cpus";
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : placement.cpus) {
+    CPU_SET(cpu, &set);
+    report << " " << cpu;
+  }
+  if (int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+    report << " (affinity failed: " << std::strerror(err) << ")";
+    ok = false;
+  }
+
+  int node = numaNodeOf(placement);
+  report << ", node " << node;
+  if (node >= 0 && static_cast<unsigned long>(node) < numa_detail::kMaxNodes) {
+    unsigned long mask = 1ul << node;
+    if (syscall(SYS_set_mempolicy, numa_detail::kMpolPreferred, &mask, numa_detail::kMaxNodes) != 0) {
+      report << " (mempolicy failed: " << std::strerror(errno) << ")";
+      ok = false;
+    }
+  }
+
+  if (placement.fifo_priority > 0) {
+    sched_param param{};
+    param.sched_priority = placement.fifo_priority;
+    if (int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) {
+      report << ", SCHED_FIFO " << placement.fifo_priority << " refused: " << std::strerror(err);
+      ok = false;
+    } else {
+      report << ", SCHED_FIFO " << placement.fifo_priority;
+    }
+  }
+  std::cerr << report.str() << "\n";
+  return ok;
+}
+
+// Applies a placement to the calling thread for the lifetime of the object,
+// then restores the thread's previous CPU mask and policies.
+class ScopedPlacement {
+public:
+  ScopedPlacement(const std::string& stage, const StagePlacement& placement) : active_(placement.pinned()) {
+    if (!active_) {
+      return;
+    }
+    CPU_ZERO(&affinity_);
+    saved_affinity_ = pthread_getaffinity_np(pthread_self(), sizeof(affinity_), &affinity_) == 0;
+    saved_sched_ = pthread_getschedparam(pthread_self(), &policy_, &param_) == 0;
+    saved_mempolicy_ =
+      syscall(SYS_get_mempolicy, &mempolicy_, &nodemask_, numa_detail::kMaxNodes, nullptr, 0ul) == 0;
+    applyPlacement(stage, placement);
+  }
+
+  ~ScopedPlacement() {
+    if (!active_) {
+      return;
+    }
+    if (saved_sched_) {
+      pthread_setschedparam(pthread_self(), policy_, &param_);
+    }
+    if (saved_mempolicy_) {
+      syscall(SYS_set_mempolicy, mempolicy_, &nodemask_, numa_detail::kMaxNodes);
+    }
+    if (saved_affinity_) {
+      pthread_setaffinity_np(pthread_self(), sizeof(affinity_), &affinity_);
+    }
+  }
+
+  ScopedPlacement(const ScopedPlacement&) = delete;
+  ScopedPlacement& operator=(const ScopedPlacement&) = delete;
+
+private:
+  bool active_;
+  bool saved_affinity_ = false;
+  bool saved_sched_ = false;
+  bool saved_mempolicy_ = false;
+  cpu_set_t affinity_;
+  int policy_ = SCHED_OTHER;
+  sched_param param_{};
+  int mempolicy_ = 0;
+  unsigned long nodemask_ = 0;
+};
+
+#endif // AFFINITY_HPP
@@ -0,0 +1,116 @@
+#ifndef CHASE_LEV_DEQUE_HPP
+#define CHASE_LEV_DEQUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+
+// Fixed-capacity Chase-Lev work-stealing deque. The owning thread pushes and
+// pops at the bottom (LIFO, cache-warm), other threads steal from the top
+// (FIFO, oldest work first). Capacity must be a power of two.
+//
+// Items are stored by value. Ownership of a slot is decided by the top/bottom
+// protocol before the item is touched, and a per-slot flag keeps the owner
+// from reusing a slot until a thief that won it has finished moving out.
+template <typename T, size_t Capacity>
+class ChaseLevDeque {
+  static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "ChaseLevDeque capacity must be a power of two");
+
+public:
+  ChaseLevDeque() = default;
+
+  ~ChaseLevDeque() {
+    auto bottom = bottom_.load(std::memory_order_relaxed);
+    for (auto i = top_.load(std::memory_order_relaxed); i < bottom; ++i) {
+      std::destroy_at(item(slots_[i & kMask]));
+    }
+  }
+
+  ChaseLevDeque(const ChaseLevDeque&) = delete;
+  ChaseLevDeque& operator=(const ChaseLevDeque&) = delete;
+
+  // Owner only. Returns false, leaving value untouched, when the deque is full.
+  bool push(T&& value) {
+    auto b = bottom_.load(std::memory_order_relaxed);
+    auto t = top_.load(std::memory_order_acquire);
+    if (b - t >= static_cast<int64_t>(Capacity)) {
+      return false;
+    }
+    Slot& slot = slots_[b & kMask];
+    if (slot.full.load(std::memory_order_acquire)) {
+      return false; // a thief is still moving the previous item out
+    }
+    ::new (static_cast<void*>(slot.storage)) T(std::move(value));
+    slot.full.store(true, std::memory_order_relaxed);
+    bottom_.store(b + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Owner only. Takes the most recently pushed item.
+  bool pop(T& value) {
+    auto b = bottom_.load(std::memory_order_relaxed) - 1;
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto t = top_.load(std::memory_order_relaxed);
+    if (t > b) {
+      bottom_.store(b + 1, std::memory_order_relaxed);
+      return false;
+    }
+    if (t == b) {
+      // Last item: race the thieves for it.
+      bool won = top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+      bottom_.store(b + 1, std::memory_order_relaxed);
+      if (!won) {
+        return false;
+      }
+    }
+    take(slots_[b & kMask], value);
+    return true;
+  }
+
+  // Any thread. Takes the oldest item.
+  bool steal(T& value) {
+    auto t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto b = bottom_.load(std::memory_order_acquire);
+    if (t >= b) {
+      return false;
+    }
+    if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+      return false;
+    }
+    take(slots_[t & kMask], value);
+    return true;
+  }
+
+  bool empty() const {
+    return bottom_.load(std::memory_order_acquire) <= top_.load(std::memory_order_acquire);
+  }
+
+private:
+  static constexpr int64_t kMask = Capacity - 1;
+
+  struct Slot {
+    std::atomic<bool> full{ false };
+    alignas(T) std::byte storage[sizeof(T)];
+  };
+
+  static T* item(Slot& slot) {
+    return std::launder(reinterpret_cast<T*>(slot.storage));
+  }
+
+  static void take(Slot& slot, T& value) {
+    T* p = item(slot);
+    value = std::move(*p);
+    std::destroy_at(p);
+    slot.full.store(false, std::memory_order_release);
+  }
+
+  alignas(64) std::atomic<int64_t> top_{ 0 };
+  alignas(64) std::atomic<int64_t> bottom_{ 0 };
+  Slot slots_[Capacity];
+};
+
+#endif // CHASE_LEV_DEQUE_HPP
@@ -2,14 +2,12 @@
 #define MESSAGE_GENERATOR
 
 #include "matching_engine.hpp"
-#include "thread_pool.hpp"
-#include "spsc_queue.hpp"
+#include "pipeline.hpp"
+#include "stages.hpp"
 
+#include <fstream>
 #include <iostream>
-#include <mutex>
-#include <queue>
 #include <string>
-#include <tuple>
 #include <vector>
 #include <random>
 #include <sstream>
@@ -18,8 +16,6 @@
 #include <csignal>
 #include <chrono>
 #include <thread>
-#include <poll.h>
-#include <unistd.h>
 
 static std::atomic<bool> shutdown{ false };
 
@@ -28,10 +24,6 @@ void signalHandler(int signum) {
     shutdown.store(true, std::memory_order_relaxed);
 }
 
-SPSCQueue<std::string, 10000> msg_q;
-SPSCQueue<MatchingEngine::token_t, 10000> token_q;
-SPSCQueue<std::pair<Order, int>, 10000> order_q;
-
 namespace {
   std::vector<std::string> generate_test_case(size_t num_messages = 100) {
     std::vector<std::string> inputs;
@@ -93,116 +85,26 @@ namespace {
   }
 }
 
-void messageGeneratorForTest() {
-  while (!shutdown) {
-    if (msg_q.size() > 5000) { // Throttle if queue is half full
-      std::this_thread::sleep_for(std::chrono::milliseconds(10));
-      continue;
-    }
-    std::vector<std::string> messages = generate_test_case(100);
-    for (auto& msg : messages) {
-      if (shutdown) break;
-      if (!msg_q.wait_push_timeout(std::move(msg), std::chrono::milliseconds(50))) {
-        std::cerr << "messageGeneratorForTest: Queue full, size=" << msg_q.size() << "\n";
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
-      }
+// Source: endless stream of random messages, for load testing.
+class RandomMessageSource {
+public:
+  SourceStatus operator()(std::string& line) {
+    if (next_ == messages_.size()) {
+      messages_ = generate_test_case(100);
+      next_ = 0;
     }
+    line = std::move(messages_[next_++]);
+    return SourceStatus::Item;
   }
-  std::cout << "messageGeneratorForTest exiting\n";
-}
-
-void messageFromConsole() {
-  MatchingEngine engine;
-  std::string line;
-  while (!shutdown) {
-    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
-    int ret = poll(&pfd, 1, 500);
-    if (ret > 0 && (pfd.revents & POLLIN)) {
-      if (std::getline(std::cin, line) && !line.empty()) {
-        if (!msg_q.push(std::move(line))) {
-          std::cerr << "msg_q full, size=" << msg_q.size() << "\n";
-          std::this_thread::yield();
-        }
-        continue;
-      }
-    } else if (ret == -1) {
-      if (shutdown) break;
-    }
-    std::this_thread::sleep_for(std::chrono::milliseconds(1));
-  }
-  msg_q.push("DUMMY");
-  std::cout << "messageFromConsole exiting\n";
-}
 
-void tokensGenerator() {
-  MatchingEngine engine;
-  MatchingEngine::token_t tokens;
-  std::string message;
-  while (!shutdown || msg_q.size() > 0) {
-    if (!msg_q.wait_pop_timeout(message, std::chrono::milliseconds(100))) {
-      continue;
-    }
-    if (message == "DUMMY") break;
-    try {
-      bool finished = engine.messageToToken(message, tokens);
-      if (!finished) {
-        std::cerr << "Error processing message: " << message << "\n";
-        tokens.clear();
-      } else {
-        if (!token_q.push(std::move(tokens))) {
-          std::cerr << "token_q full, size=" << token_q.size() << "\n";
-          std::this_thread::yield();
-        }
-      }
-    } catch (const std::exception& e) {
-      std::cerr << "Exception in tokensGenerator: " << e.what() << " for message: " << message << "\n";
-    }
-  }
-  token_q.push(MatchingEngine::token_t{});
-  std::cout << "tokensGenerator exiting\n";
-}
+private:
+  std::vector<std::string> messages_;
+  size_t next_ = 0;
+};
 
-void ordersGenerator() {
-  MatchingEngine engine;
-  MatchingEngine::token_t tokens;
-  Order order;
-  while (!shutdown || token_q.size() > 0) {
-    if (!token_q.wait_pop_timeout(tokens, std::chrono::milliseconds(100))) {
-      continue;
-    }
-    if (tokens.empty()) break;
-    int msg_type = -1;
-    int sz = -1;
-    order = engine.processTokens(tokens, msg_type, sz);
-    if (sz > 0) {
-      if (!order_q.push(std::make_pair(std::move(order), msg_type))) {
-        // std::cerr << "order_q full, size=" << order_q.size() << "\n";
-        std::this_thread::yield();
-      }
-    }
-  }
-  order_q.push(std::make_pair(Order{}, -1));
-  std::cout << "ordersGenerator exiting\n";
-}
-
-void orderProcessor() {
-  thread_local MatchingEngine engine;
-  std::pair<Order, int> order_info;
-  while (!shutdown || order_q.size() > 0) {
-    if (!order_q.wait_pop_timeout(order_info, std::chrono::milliseconds(100))) {
-      continue;
-    }
-    if (order_info.second == -1) break;
-    if (order_info.second == 0) {
-      engine.addOrder(order_info.first.order_id, order_info.first.quantity, order_info.first.price, order_info.first.side);
-    } else if (order_info.second == 1) {
-      engine.cancelOrder(order_info.first.order_id);
-    }
-  }
-  std::cout << "orderProcessor exiting\n";
-}
-
-void matching_engine_mt() {
+// Runs the pipeline on stdin. With shards > 0 the books are spread over that
+// many matching threads and topology is ignored.
+void matching_engine_mt(Topology topology = Topology::Split, size_t shards = 0) {
   struct sigaction sa;
   sa.sa_handler = signalHandler;
   sa.sa_flags = SA_RESTART;
@@ -212,24 +114,73 @@ void matching_engine_mt() {
     return;
   }
 
-  ThreadPool threadPool{ std::thread::hardware_concurrency() };
-  
-  
-  // threadPool.push(messageGeneratorForTest); // TEST ONLY
-  
-  
-  threadPool.push(messageFromConsole);
-  threadPool.push(tokensGenerator);
-  threadPool.push(ordersGenerator);
-  threadPool.push(orderProcessor);
-  while (!shutdown) {
+  Pipeline pipeline;
+  if (shards > 0) {
+    wireShardedPipeline(pipeline, ConsoleReader{}, shards);
+  } else {
+    wireMatchingPipeline(pipeline, ConsoleReader{}, topology);
+  }
+  // wireMatchingPipeline(pipeline, RandomMessageSource{}, topology); // TEST ONLY
+  pipeline.start();
+
+  while (!shutdown && !pipeline.finished()) {
     std::this_thread::sleep_for(std::chrono::milliseconds(100));
   }
-  msg_q.push("DUMMY");
-  token_q.push(MatchingEngine::token_t{});
-  order_q.push(std::make_pair(Order{}, -1));
-  threadPool.stop();
+  pipeline.stop();
+  pipeline.report(std::cerr);
   std::cout << "All threads cleaned up. Exiting.\n";
 }
 
+// Replays the messages of one input file through every topology and reports
+// the throughput of each. Execution reports go to a null stream so that the
+// comparison measures the pipeline rather than the terminal.
+int runTopologyBenchmark(const std::string& path, int iterations) {
+  std::ifstream in(path);
+  if (!in.is_open()) {
+    std::cerr << "Could not open " << path << "\n";
+    return 1;
+  }
+  std::vector<std::string> messages;
+  std::string line;
+  while (std::getline(in, line)) {
+    if (!line.empty()) {
+      messages.push_back(line);
+    }
+  }
+
+  std::ostream null_stream(nullptr);
+  logger.set_out_stream(&null_stream, &null_stream);
+  logger.set_enabled(false);
+
+  std::cout << "messages: " << messages.size() << ", iterations: " << iterations << "\n";
+  for (Topology topology : { Topology::Split, Topology::FuseDecode, Topology::Fused }) {
+    double best = 0;
+    double total = 0;
+    for (int i = 0; i < iterations; ++i) {
+      // Time the messages only, not thread startup and placement.
+      std::atomic<bool> go{ false };
+      Pipeline pipeline;
+      wireMatchingPipeline(pipeline, GatedSource(VectorSource(messages), go), topology);
+      pipeline.start();
+      while (!pipeline.running()) {
+        std::this_thread::yield();
+      }
+      auto start = std::chrono::steady_clock::now();
+      go.store(true, std::memory_order_release);
+      pipeline.wait();
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      total += elapsed.count();
+      best = (i == 0) ? elapsed.count() : std::min(best, elapsed.count());
+    }
+    std::cout << std::left << std::setw(12) << topologyName(topology) << std::right << std::fixed << std::setprecision(3)
+              << " best " << std::setw(9) << best * 1e3 << " ms"
+              << "  mean " << std::setw(9) << total / iterations * 1e3 << " ms"
+              << "  " << std::setw(12) << std::setprecision(0) << messages.size() / best << " msg/s\n";
+  }
+
+  logger.set_out_stream(nullptr, nullptr);
+  logger.set_enabled(true);
+  return 0;
+}
+
 #endif
\ No newline at end of file
@@ -1,7 +1,8 @@
 #ifndef LOGGER_HPP
 #define LOGGER_HPP
 
-#include "spsc_queue.hpp"
+#include "mpmc_queue.hpp"
+#include <chrono>
 #include <iostream>
 #include <string>
 #include <thread>
@@ -15,7 +16,7 @@ public:
 
   ~Logger() {
     shutdown_.store(true, std::memory_order_release);
-    shutdown_.notify_one();
+    queue_.wake_all();
     thread_.join();
   }
 
@@ -33,9 +34,7 @@ public:
       *out_stream_.load(std::memory_order_acquire) << msg << std::endl;
       return;
     }
-    if (!queue_.push("OUT: " + msg)) {
-      std::this_thread::yield();
-    }
+    enqueue("OUT: " + msg);
   }
 
   void log_err(const std::string& msg) {
@@ -43,16 +42,22 @@ public:
       *err_stream_.load(std::memory_order_acquire) << msg << std::endl;
       return;
     }
-    if (!queue_.push("ERR: " + msg)) {
+    enqueue("ERR: " + msg);
+  }
+
+private:
+  // Any thread may log (the matching shards do so concurrently). A full queue
+  // applies back-pressure instead of dropping the line.
+  void enqueue(std::string msg) {
+    while (!queue_.push(std::move(msg))) {
       std::this_thread::yield();
     }
   }
 
-private:
   void run() {
     while (true) {
       std::string msg;
-      if (!queue_.pop(msg)) {
+      if (!queue_.wait_pop_timeout(msg, std::chrono::milliseconds(100))) {
         if (shutdown_.load(std::memory_order_acquire)) {
           break;
         }
@@ -63,7 +68,7 @@ private:
     }
   }
 
-  SPSCQueue<std::string, 1000> queue_;
+  MPMCQueue<std::string, 1024> queue_;
   std::thread thread_;
   std::atomic<bool> shutdown_{ false };
   std::atomic<bool> enabled_{ true };
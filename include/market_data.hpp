@@ -0,0 +1,171 @@
+#ifndef MARKET_DATA_HPP
+#define MARKET_DATA_HPP
+
+#include "matching_engine.hpp"
+#include "seqlock.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Best bid and offer of one instrument. A side with quantity 0 is empty.
+struct Bbo {
+  double bid_price = 0;
+  uint64_t bid_quantity = 0;
+  double ask_price = 0;
+  uint64_t ask_quantity = 0;
+  uint64_t sequence = 0; // publications so far for this instrument; 0 = none
+
+  bool sameQuote(const Bbo& other) const {
+    return bid_price == other.bid_price && bid_quantity == other.bid_quantity &&
+           ask_price == other.ask_price && ask_quantity == other.ask_quantity;
+  }
+};
+
+// Conflating top-of-book channel: one seqlock slot per instrument holding
+// only the latest BBO. The matching thread overwrites the slot whenever the
+// quote changes and never waits for or queues on behalf of readers; a slow
+// reader simply skips the quotes it was too slow to see (compare sequence
+// with the last one it read).
+//
+// Slots are allocated up front for instrument ids below max_instruments, so
+// readers never race with a resize; higher ids are not published.
+class BboPublisher {
+public:
+  explicit BboPublisher(size_t max_instruments)
+    : slots_(std::make_unique<Seqlock<Bbo>[]>(max_instruments)), last_(max_instruments), capacity_(max_instruments) {}
+
+  size_t capacity() const { return capacity_; }
+
+  // Writer side: called by the engine at the end of a message.
+  void publish(InstrumentId instrument, Bbo bbo) {
+    if (instrument >= capacity_) {
+      return;
+    }
+    Bbo& last = last_[instrument];
+    if (last.sequence != 0 && last.sameQuote(bbo)) {
+      return;
+    }
+    bbo.sequence = last.sequence + 1;
+    last = bbo;
+    slots_[instrument].store(bbo);
+  }
+
+  // Reader side, from any thread. False if nothing was published yet.
+  bool read(InstrumentId instrument, Bbo& bbo) const {
+    if (instrument >= capacity_) {
+      return false;
+    }
+    bbo = slots_[instrument].load();
+    return bbo.sequence != 0;
+  }
+
+private:
+  std::unique_ptr<Seqlock<Bbo>[]> slots_;
+  std::vector<Bbo> last_; // writer's copy, so change detection never reads the slots
+  size_t capacity_;
+};
+
+constexpr size_t kBookViewDepth = 10;
+
+// Top kBookViewDepth levels of both sides of one instrument, as of the end
+// of one message.
+struct BookView {
+  BookDepth<kBookViewDepth> depth;
+  uint64_t sequence = 0; // publications so far for this instrument; 0 = none
+
+  bool sameDepth(const BookView& other) const {
+    return sameSide(depth.bids, depth.bid_levels, other.depth.bids, other.depth.bid_levels) &&
+           sameSide(depth.asks, depth.ask_levels, other.depth.asks, other.depth.ask_levels);
+  }
+
+private:
+  template <typename Levels>
+  static bool sameSide(const Levels& a, size_t na, const Levels& b, size_t nb) {
+    if (na != nb) {
+      return false;
+    }
+    for (size_t i = 0; i < na; ++i) {
+      if (a[i].price != b[i].price || a[i].quantity != b[i].quantity || a[i].count != b[i].count) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+// Lock-free read access to book state for threads other than the matching
+// thread (risk, surveillance). The engine republishes an instrument's
+// BookView into its seqlock slot at the end of every message that changed
+// it; readers copy a consistent view without taking a lock or making the
+// writer wait. Like BboPublisher, slots exist for ids below max_instruments.
+class BookViewPublisher {
+public:
+  explicit BookViewPublisher(size_t max_instruments)
+    : slots_(std::make_unique<Seqlock<BookView>[]>(max_instruments)), last_(max_instruments), capacity_(max_instruments) {}
+
+  size_t capacity() const { return capacity_; }
+
+  // Writer side: called by the engine at the end of a message.
+  void publish(InstrumentId instrument, const BookView& view) {
+    if (instrument >= capacity_) {
+      return;
+    }
+    BookView& last = last_[instrument];
+    if (last.sequence != 0 && last.sameDepth(view)) {
+      return;
+    }
+    uint64_t sequence = last.sequence + 1;
+    last = view;
+    last.sequence = sequence;
+    slots_[instrument].store(last);
+  }
+
+  // Reader side, from any thread. False if nothing was published yet.
+  bool read(InstrumentId instrument, BookView& view) const {
+    if (instrument >= capacity_) {
+      return false;
+    }
+    view = slots_[instrument].load();
+    return view.sequence != 0;
+  }
+
+  bool bestPrices(InstrumentId instrument, PriceLevel& bid, PriceLevel& ask) const {
+    BookView view;
+    if (!read(instrument, view)) {
+      return false;
+    }
+    bid = view.depth.bid_levels ? view.depth.bids[0] : PriceLevel{};
+    ask = view.depth.ask_levels ? view.depth.asks[0] : PriceLevel{};
+    return true;
+  }
+
+  // Resting quantity at price (0 if no level there). False when the view
+  // cannot tell: nothing published yet, or the side filled all
+  // kBookViewDepth slots and price lies beyond the last of them.
+  bool quantityAt(InstrumentId instrument, Side side, double price, uint64_t& quantity) const {
+    BookView view;
+    if (!read(instrument, view)) {
+      return false;
+    }
+    const auto& levels = (side == Side::Buy) ? view.depth.bids : view.depth.asks;
+    size_t n = (side == Side::Buy) ? view.depth.bid_levels : view.depth.ask_levels;
+    for (size_t i = 0; i < n; ++i) {
+      if (levels[i].price == price) {
+        quantity = levels[i].quantity;
+        return true;
+      }
+    }
+    bool beyond = n == kBookViewDepth && (side == Side::Buy ? price < levels[n - 1].price : price > levels[n - 1].price);
+    quantity = 0;
+    return !beyond;
+  }
+
+private:
+  std::unique_ptr<Seqlock<BookView>[]> slots_;
+  std::vector<BookView> last_;
+  size_t capacity_;
+};
+
+#endif // MARKET_DATA_HPP
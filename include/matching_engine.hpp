@@ -2,18 +2,34 @@
 #define MATCHING_ENGINE_H
 
 #include "logger.hpp"
+#include "order_index.hpp"
 
-#include <deque>
+#include <array>
+#include <cstring>
+#include <functional>
 #include <map>
+#include <memory>
+#include <memory_resource>
+#include <ostream>
+#include <span>
 #include <unordered_map>
 #include <string>
+#include <string_view>
 #include <vector>
-#include <variant>
 
 extern Logger logger;
 
+struct Bbo;
+class BboPublisher;
+class BookViewPublisher;
+
 enum class Side { Buy, Sell };
 
+// Limit orders rest their remainder (GTC). IOC, FOK and market orders never
+// rest: IOC trades what it can up to its limit, FOK trades its full size or
+// nothing, and a market order trades what it can at any price.
+enum class OrderType : uint8_t { Limit, IOC, FOK, Market };
+
 struct alignas(8) Order {
   uint64_t order_id;
   uint64_t quantity;
@@ -21,38 +37,297 @@ struct alignas(8) Order {
   Side side;
 };
 
+// Instrument symbol of up to 8 characters packed into an integer, so that it
+// can be hashed and compared without touching a string. 0 is the default
+// instrument used by messages that carry no symbol.
+using Symbol = uint64_t;
+
+constexpr size_t kMaxSymbolLength = sizeof(Symbol);
+
+inline bool makeSymbol(std::string_view name, Symbol& symbol) {
+  if (name.empty() || name.size() > kMaxSymbolLength) {
+    return false;
+  }
+  symbol = 0;
+  std::memcpy(&symbol, name.data(), name.size());
+  return true;
+}
+
+inline std::string symbolName(Symbol symbol) {
+  char name[kMaxSymbolLength];
+  std::memcpy(name, &symbol, sizeof(name));
+  return std::string(name, strnlen(name, sizeof(name)));
+}
+
+// A decoded inbound message:
+//   0,order_id,side,quantity,price[,symbol[,type]]   add
+//   1,order_id                                       cancel
+//   5,order_id,quantity,price                        modify (quantity 0 cancels)
+//   6,order_id,quantity                              reduce by quantity
+// Messages without a symbol (or with an empty one) address the default
+// instrument. type is GTC (the default), IOC, FOK or MKT; the price of a
+// market order is ignored.
+struct OrderMsg {
+  Order order;
+  int msg_type = -1;
+  Symbol symbol = 0;
+  OrderType type = OrderType::Limit;
+};
+
+
+
+// Dense id of an instrument inside one MatchingEngine, assigned in order of
+// first use. The default instrument (symbol 0) always has id 0.
+using InstrumentId = uint32_t;
+
+constexpr InstrumentId kDefaultInstrument = 0;
+
+// Typed execution report. The text form (operator<<) is the engine's output
+// line: "2,quantity,price" for a trade, "3,order_id" for a fully filled
+// order, "4,order_id,remaining" for a partially filled one and
+// "7,order_id,quantity" for the unfilled quantity of an IOC, FOK or market
+// order that was killed instead of resting.
+enum class ReportType : uint8_t { Trade = 2, FullyFilled = 3, PartiallyFilled = 4, Expired = 7 };
+
+struct ExecutionReport {
+  ReportType type;
+  uint64_t order_id; // 0 for trades
+  uint64_t quantity; // traded quantity, or what remains of a partially filled or expired order
+  double price;      // trades only
+};
+
+std::ostream& operator<<(std::ostream& os, const ExecutionReport& report);
+
+// How fills of an aggressive order are reported. Every fill always produces
+// a trade event and a report for the resting order; Verbose also reports the
+// aggressor after every fill, while PerLevel and PerMessage report it once
+// per price level swept or once per message, with its remaining quantity.
+enum class FillReporting : uint8_t { Verbose, PerLevel, PerMessage };
+
+// Aggregate state of one price level: total resting quantity and number of
+// resting orders.
+struct PriceLevel {
+  double price = 0;
+  uint64_t quantity = 0;
+  uint32_t count = 0;
+};
+
+// One entry of the level-change (L2 delta) feed: the new aggregate state of
+// a price level after a message, or its removal.
+enum class LevelAction : uint8_t { Add, Change, Remove };
+
+struct LevelUpdate {
+  InstrumentId instrument;
+  Side side;
+  LevelAction action;
+  double price;
+  uint64_t quantity; // 0 for Remove
+  uint32_t count;    // 0 for Remove
+};
 
+// Top-of-book depth of both sides, best level first, in storage the caller
+// owns and reuses between snapshots.
+template <size_t N>
+struct BookDepth {
+  std::array<PriceLevel, N> bids;
+  std::array<PriceLevel, N> asks;
+  size_t bid_levels = 0;
+  size_t ask_levels = 0;
+};
 
+// Matches orders for any number of instruments. Each instrument has its own
+// book, found by dense id in the book directory; switching between books is
+// one vector index. Order ids are unique across the whole engine: a single
+// index maps each resting order id to its node, which records the book it
+// rests in.
+//
+// Resting orders are intrusive nodes linked FIFO within their price level, so
+// a cancel unlinks in O(1) instead of searching the level. Order nodes, price
+// levels and the books themselves all come from one pool arena owned by the
+// engine, so many small books share pages instead of each holding its own
+// allocations. Every level caches its total quantity and order count, kept
+// current in O(1) by each add, fill, modify, reduce and cancel.
 class MatchingEngine {
 public:
-  MatchingEngine() = default;
+  MatchingEngine();
+  ~MatchingEngine();
+
+  MatchingEngine(MatchingEngine&&) = default;
+  MatchingEngine& operator=(MatchingEngine&&) = delete;
 
   using token_t = std::vector<std::string>;
-  using buy_book_t = std::map<double, std::deque<Order>, std::greater<double>>;
-  using sell_book_t = std::map<double, std::deque<Order>>;
-  using book_t = std::variant<buy_book_t, sell_book_t>;
 
   void processMessage(std::string const& message);
 
   bool messageToToken(std::string const& message, token_t& tokens);
   Order processTokens(token_t const& tokens, int& msg_type, int& sz);
+  void processTokens(token_t const& tokens, Order& order, int& msg_type, int& sz);
+  void processTokens(token_t const& tokens, OrderMsg& msg, int& sz);
 
-  void addOrder(uint64_t order_id, uint64_t quantity, double price, Side side);
+  // Book directory. instrument() creates the book on first use.
+  InstrumentId instrument(Symbol symbol);
+  bool findInstrument(Symbol symbol, InstrumentId& id) const;
+  Symbol symbolOf(InstrumentId id) const { return m_books[id]->symbol; }
+  size_t instrumentCount() const { return m_books.size(); }
+  size_t restingOrderCount() const { return m_orderIndex.size(); }
+
+  void addOrder(uint64_t order_id, uint64_t quantity, double price, Side side,
+                InstrumentId instrument = kDefaultInstrument, OrderType type = OrderType::Limit);
   void cancelOrder(uint64_t order_id);
+  void modifyOrder(uint64_t order_id, uint64_t quantity, double price);
+  void reduceOrder(uint64_t order_id, uint64_t quantity);
+
+  // Applies decoded messages (add, cancel, modify, reduce) in order, with the
+  // same results as making the calls one at a time. Memory accesses of
+  // upcoming messages are prefetched a few messages ahead (see
+  // setPrefetchDistance), consecutive messages for the same symbol share one
+  // directory lookup, and without a report buffer the batch's output goes to
+  // the logger as a single write.
+  void processBatch(std::span<const OrderMsg> messages);
+
+  // How far ahead processBatch prefetches: the index slots of the order ids
+  // 2 * distance messages ahead, the order nodes distance ahead and, from a
+  // distance of 2, the price level of the next message. 0 applies each
+  // message cold.
+  void setPrefetchDistance(size_t distance) { m_prefetchDistance = distance; }
+
+  void setFillReporting(FillReporting mode) { m_fillReporting = mode; }
+
+  // While a buffer is set, execution reports are appended to it as typed
+  // ExecutionReports instead of being written through the logger, so the
+  // caller decides when and how to publish them (e.g. once per batch).
+  // Clearing the buffer between uses keeps its capacity, so a reused buffer
+  // stops allocating. Null restores logger output.
+  void setReportBuffer(std::vector<ExecutionReport>* buffer) { m_reports = buffer; }
+
+  // While a buffer is set, the id of every limit add is appended once its
+  // order leaves the book, or at once if it never rested. Null turns it off.
+  void setRetiredOrderBuffer(std::vector<uint64_t>* buffer) { m_retired = buffer; }
+
+  // Level aggregates. levelAt() reports an empty level for a price with no
+  // resting orders. quantityThrough() sums the side from its best price up
+  // to and including limit (bids at or above it, asks at or below it).
+  PriceLevel levelAt(InstrumentId instrument, Side side, double price) const;
+  uint64_t quantityThrough(InstrumentId instrument, Side side, double limit) const;
+
+  // Copies up to out.size() levels of one side, best first, and returns how
+  // many were written. Reads cached aggregates only: O(levels copied), no
+  // allocation.
+  size_t depth(InstrumentId instrument, Side side, std::span<PriceLevel> out) const;
+
+  template <size_t N>
+  void snapshot(InstrumentId instrument, BookDepth<N>& depth_out) const {
+    depth_out.bid_levels = depth(instrument, Side::Buy, depth_out.bids);
+    depth_out.ask_levels = depth(instrument, Side::Sell, depth_out.asks);
+  }
+
+  // Level-change feed. While a buffer is set, each message appends one
+  // LevelUpdate per price level whose aggregate it changed, in the order the
+  // levels were first touched. The caller drains (clears) the buffer; null
+  // turns the feed off.
+  void setLevelUpdateBuffer(std::vector<LevelUpdate>* buffer) { m_levelUpdates = buffer; }
+
+  // Top-of-book feed: after each message, the BBO of every instrument the
+  // message touched is offered to the publisher, which keeps the latest.
+  void setBboPublisher(BboPublisher* publisher) { m_bboPublisher = publisher; }
+
+  // Reader-safe book views: likewise, the top levels of every instrument a
+  // message touched are republished for lock-free readers on other threads.
+  void setBookViewPublisher(BookViewPublisher* publisher) { m_bookViewPublisher = publisher; }
 
 private:
+  struct Level;
+
+  struct OrderNode {
+    Order order;
+    OrderNode* prev;
+    OrderNode* next;
+    Level* level;
+    InstrumentId instrument;
+  };
+
+  struct Level {
+    OrderNode* head = nullptr;
+    OrderNode* tail = nullptr;
+    uint64_t quantity = 0;
+    uint32_t count = 0;
+  };
 
-  void matchOrder(Order& aggressive_order);
-  void addToBook(Order const& order);
+  using buy_book_t = std::pmr::map<double, Level, std::greater<double>>;
+  using sell_book_t = std::pmr::map<double, Level>;
+
+  struct Book {
+    Book(Symbol symbol, std::pmr::memory_resource* arena)
+      : symbol(symbol), bids(arena), asks(arena), bid_hint(bids.end()), ask_hint(asks.end()) {}
+
+    Symbol symbol;
+    buy_book_t bids;
+    sell_book_t asks;
+    // Level of the latest insertion on each side. An order at the same price
+    // as the one before it (bursts at the touch, re-queued modifies) joins it
+    // without a tree search. Reset to end() whenever that level is erased.
+    buy_book_t::iterator bid_hint;
+    sell_book_t::iterator ask_hint;
+  };
+
+  template <typename Levels>
+  void matchOrder(Order& aggressive_order, Levels& opposite_book, typename Levels::iterator& opposite_hint);
+  template <typename Levels>
+  static bool crosses(Levels const& opposite_book, double price);
+  template <typename Levels>
+  static void eraseLevel(Levels& levels, typename Levels::iterator& hint, typename Levels::iterator it);
+  template <typename Levels>
+  static uint64_t sumThrough(Levels const& levels, double limit, uint64_t cap);
+  template <typename Levels>
+  static PriceLevel levelAt(Levels const& levels, double price);
+  template <typename Levels>
+  static size_t copyDepth(Levels const& levels, std::span<PriceLevel> out);
+  void addToBook(Book& book, InstrumentId instrument, Order const& order);
+  void linkOrder(Book& book, OrderNode* node);
+  void unlinkOrder(OrderNode* node);
+  void detachOrder(Book& book, OrderNode* node);
+  void releaseOrder(OrderNode* node);
+  void retireOrder(uint64_t order_id);
+  void applyMessage(OrderMsg const& msg, InstrumentId instrument);
+  void prefetchOrder(OrderMsg const& msg, bool level) const;
+  void noteLevel(InstrumentId instrument, Side side, double price, Level const* level);
+  void publishMarketData();
+  void publishLevelUpdates();
+  static Bbo bestBidOffer(Book const& book);
   bool parseMessage(std::string const& message, std::vector<std::string>& tokens);
 
   void emitTradeEvent(uint64_t quantity, double price);
   void emitFullyFilled(uint64_t order_id);
   void emitPartiallyFilled(uint64_t order_id, uint64_t quantity);
+  void emitExpired(uint64_t order_id, uint64_t quantity);
+  void emitOrderStatus(Order const& order);
+  void emit(ExecutionReport const& report);
+
+  // Declared first so that it outlives every container allocating from it.
+  std::unique_ptr<std::pmr::unsynchronized_pool_resource> m_arena;
+  std::vector<Book*> m_books;
+  std::unordered_map<Symbol, InstrumentId> m_instrumentIds;
+  OrderIndex<OrderNode*> m_orderIndex;
+  FillReporting m_fillReporting = FillReporting::Verbose;
+  size_t m_prefetchDistance = 4;
+
+  // State of each level the current message has touched, before it did.
+  struct TouchedLevel {
+    InstrumentId instrument;
+    Side side;
+    double price;
+    bool existed;
+    uint64_t quantity;
+    uint32_t count;
+  };
 
-  buy_book_t m_buyOrderBook;
-  sell_book_t m_sellOrderBook;
-  std::unordered_map<uint64_t, Order> m_orderMap;
+  std::vector<ExecutionReport>* m_reports = nullptr;
+  std::vector<ExecutionReport> m_batchReports; // processBatch output when m_reports is null
+  std::vector<LevelUpdate>* m_levelUpdates = nullptr;
+  std::vector<uint64_t>* m_retired = nullptr;
+  BboPublisher* m_bboPublisher = nullptr;
+  BookViewPublisher* m_bookViewPublisher = nullptr;
+  std::vector<TouchedLevel> m_touchedLevels;
 };
 
 #endif
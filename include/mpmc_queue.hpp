@@ -0,0 +1,158 @@
+#ifndef MPMC_QUEUE_HPP
+#define MPMC_QUEUE_HPP
+
+#include "wait_strategy.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+
+// Bounded multi-producer multi-consumer queue (Dmitry Vyukov's design).
+// Every cell carries a sequence number that tells producers and consumers
+// whose turn it is, so each side only contends on its own position counter
+// and a single CAS claims a cell. Capacity must be a power of two.
+template <typename T, size_t Capacity, typename WaitStrategy = SpinParkWait>
+class MPMCQueue {
+  static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "MPMCQueue capacity must be a power of two");
+
+public:
+  MPMCQueue() {
+    for (size_t i = 0; i < Capacity; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  ~MPMCQueue() {
+    auto head = enqueue_pos_.load(std::memory_order_relaxed);
+    for (auto pos = dequeue_pos_.load(std::memory_order_relaxed); pos != head; ++pos) {
+      std::destroy_at(std::launder(reinterpret_cast<T*>(cells_[pos & kMask].storage)));
+    }
+  }
+
+  MPMCQueue(const MPMCQueue&) = delete;
+  MPMCQueue& operator=(const MPMCQueue&) = delete;
+
+  template <typename... Args>
+  bool emplace(Args&&... args) {
+    auto pos = enqueue_pos_.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &cells_[pos & kMask];
+      auto seq = cell->sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false; // Queue is full
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    ::new (static_cast<void*>(cell->storage)) T(std::forward<Args>(args)...);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    not_empty_.notify();
+    return true;
+  }
+
+  bool push(const T& value) {
+    return emplace(value);
+  }
+
+  bool push(T&& value) {
+    return emplace(std::move(value));
+  }
+
+  bool pop(T& value) {
+    auto pos = dequeue_pos_.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &cells_[pos & kMask];
+      auto seq = cell->sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false; // Queue is empty
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    T* item = std::launder(reinterpret_cast<T*>(cell->storage));
+    value = std::move(*item);
+    std::destroy_at(item);
+    cell->sequence.store(pos + Capacity, std::memory_order_release);
+    not_full_.notify();
+    return true;
+  }
+
+  bool wait_push_timeout(T&& value, const std::chrono::milliseconds& timeout) {
+    auto deadline = wait_clock::now() + timeout;
+    while (!push(std::move(value))) {
+      if (!not_full_.wait([this] { return !full(); }, deadline)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool wait_pop_timeout(T& value, const std::chrono::milliseconds& timeout) {
+    auto deadline = wait_clock::now() + timeout;
+    // Another consumer may win the race for the item we were woken for.
+    while (!pop(value)) {
+      if (!not_empty_.wait([this] { return !empty(); }, deadline)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Wakes every parked producer and consumer, e.g. so they can observe shutdown.
+  void wake_all() {
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+  // A cell that is ahead of the observed position means the position was
+  // stale, which counts as "not empty"/"not full" so that waiters retry.
+  bool empty() const {
+    auto pos = dequeue_pos_.load(std::memory_order_relaxed);
+    auto seq = cells_[pos & kMask].sequence.load(std::memory_order_acquire);
+    return static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1) < 0;
+  }
+
+  bool full() const {
+    auto pos = enqueue_pos_.load(std::memory_order_relaxed);
+    auto seq = cells_[pos & kMask].sequence.load(std::memory_order_acquire);
+    return static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos) < 0;
+  }
+
+  // Approximate while other threads are pushing or popping.
+  size_t size() const {
+    auto head = enqueue_pos_.load(std::memory_order_acquire);
+    auto tail = dequeue_pos_.load(std::memory_order_acquire);
+    return head > tail ? head - tail : 0;
+  }
+
+private:
+  static constexpr size_t kMask = Capacity - 1;
+
+  struct Cell {
+    std::atomic<size_t> sequence;
+    alignas(T) std::byte storage[sizeof(T)];
+  };
+
+  Cell cells_[Capacity];
+  alignas(64) std::atomic<size_t> enqueue_pos_{ 0 };
+  alignas(64) std::atomic<size_t> dequeue_pos_{ 0 };
+  [[no_unique_address]] WaitStrategy not_empty_;
+  [[no_unique_address]] WaitStrategy not_full_;
+};
+
+#endif // MPMC_QUEUE_HPP
@@ -0,0 +1,123 @@
+#ifndef ORDER_INDEX_HPP
+#define ORDER_INDEX_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Open-addressing hash map from order id to a resting-order handle. Entries
+// live in one flat array (linear probing, backward-shift deletion), so a
+// lookup is usually a single cache line and the slot of an upcoming id can be
+// prefetched. Handle must be a pointer type; nullptr marks an empty slot.
+template <typename Handle>
+class OrderIndex {
+  static_assert(std::is_pointer_v<Handle>, "OrderIndex handles are pointers");
+
+public:
+  explicit OrderIndex(size_t capacity = 1024) : slots_(roundUp(capacity)) { resize(); }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  Handle find(uint64_t order_id) const {
+    for (size_t i = home(order_id);; i = (i + 1) & mask_) {
+      const Slot& slot = slots_[i];
+      if (!slot.handle || slot.order_id == order_id) {
+        return slot.handle;
+      }
+    }
+  }
+
+  // Returns false if the id is already present.
+  bool insert(uint64_t order_id, Handle handle) {
+    if ((size_ + 1) * 2 > slots_.size()) {
+      grow();
+    }
+    size_t i = home(order_id);
+    for (; slots_[i].handle; i = (i + 1) & mask_) {
+      if (slots_[i].order_id == order_id) {
+        return false;
+      }
+    }
+    slots_[i] = Slot{ order_id, handle };
+    ++size_;
+    return true;
+  }
+
+  bool erase(uint64_t order_id) {
+    size_t i = home(order_id);
+    for (; slots_[i].handle; i = (i + 1) & mask_) {
+      if (slots_[i].order_id == order_id) {
+        break;
+      }
+    }
+    if (!slots_[i].handle) {
+      return false;
+    }
+    // Pull later members of the probe run back over the hole, so lookups
+    // never need tombstones.
+    for (size_t j = (i + 1) & mask_; slots_[j].handle; j = (j + 1) & mask_) {
+      size_t want = home(slots_[j].order_id);
+      if (((j - want) & mask_) >= ((j - i) & mask_)) {
+        slots_[i] = slots_[j];
+        i = j;
+      }
+    }
+    slots_[i] = Slot{};
+    --size_;
+    return true;
+  }
+
+  // Brings the home slot of order_id into cache ahead of a find/erase.
+  void prefetch(uint64_t order_id) const {
+    __builtin_prefetch(&slots_[home(order_id)]);
+  }
+
+private:
+  struct Slot {
+    uint64_t order_id = 0;
+    Handle handle = nullptr;
+  };
+
+  static size_t roundUp(size_t n) {
+    size_t capacity = 16;
+    while (capacity < n) {
+      capacity *= 2;
+    }
+    return capacity;
+  }
+
+  // Fibonacci hashing: the top bits of id * 2^64/phi pick the home slot.
+  size_t home(uint64_t order_id) const {
+    return static_cast<size_t>((order_id * 0x9E3779B97F4A7C15ull) >> shift_);
+  }
+
+  void resize() {
+    mask_ = slots_.size() - 1;
+    shift_ = 64;
+    for (size_t n = slots_.size(); n > 1; n /= 2) {
+      --shift_;
+    }
+  }
+
+  void grow() {
+    std::vector<Slot> old(slots_.size() * 2);
+    old.swap(slots_);
+    resize();
+    size_ = 0;
+    for (const Slot& slot : old) {
+      if (slot.handle) {
+        insert(slot.order_id, slot.handle);
+      }
+    }
+  }
+
+  std::vector<Slot> slots_;
+  size_t mask_ = 0;
+  unsigned shift_ = 64;
+  size_t size_ = 0;
+};
+
+#endif // ORDER_INDEX_HPP
@@ -0,0 +1,430 @@
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include "affinity.hpp"
+#include "spsc_queue.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// A pipeline is a chain of stages, each running on its own thread and
+// connected by SPSC rings. A stage wraps a processor:
+//
+//   source:    SourceStatus operator()(Out& out)   fills the next item
+//   transform: bool operator()(In& in, Out& out)   false drops the item
+//   sink:      void operator()(In& in)
+//
+// A processor may also provide flush(), called after every batch, and
+// finish(), called once when its stage exits; a sink that feeds rings of its
+// own uses them to publish and close those rings.
+//
+// Outputs are constructed directly in the downstream ring (claim/commit) and
+// inputs are processed in place (peek/release), up to kStageBatchSize items
+// per wake-up. Shutdown is a drain protocol rather than sentinel values: when
+// asked to stop, sources close their output ring, and each downstream stage
+// finishes what is queued, closes its own output and exits.
+
+constexpr size_t kStageBatchSize = 64;
+
+template <typename T>
+using StageQueue = SPSCQueue<T, 10000, PlacementWait>;
+
+enum class SourceStatus { Item, Idle, Done };
+
+struct StageCounters {
+  std::atomic<uint64_t> received{ 0 };   // items taken from the input ring
+  std::atomic<uint64_t> emitted{ 0 };    // items published downstream
+  std::atomic<uint64_t> dropped{ 0 };    // items the processor rejected
+  std::atomic<uint64_t> batches{ 0 };    // non-empty wake-ups
+  std::atomic<uint64_t> idle_waits{ 0 }; // waits on an empty input ring
+};
+
+struct NoQueue {};
+
+// Claims the next free slot of the downstream queue, publishing the slots
+// claimed so far and waiting while it is full. Returns nullptr once the queue
+// is closed by its consumer or stop is raised.
+template <typename Queue>
+auto* claimSlot(Queue& queue, const std::atomic<bool>* stop = nullptr) {
+  auto* slot = queue.claim();
+  while (!slot) {
+    queue.commit();
+    if (queue.closed() || (stop && stop->load(std::memory_order_relaxed))) {
+      return decltype(slot){};
+    }
+    slot = queue.wait_claim_timeout(std::chrono::milliseconds(100));
+  }
+  return slot;
+}
+
+// Pinned stages busy-spin on their rings instead of parking on a futex.
+template <typename Wait>
+void spinIfPinned(Wait& wait, const StagePlacement& placement) {
+  if constexpr (requires { wait.set_spin(true); }) {
+    wait.set_spin(placement.pinned());
+  }
+}
+
+template <typename Processor>
+void flushProcessor(Processor& processor) {
+  if constexpr (requires { processor.flush(); }) {
+    processor.flush();
+  }
+}
+
+template <typename Processor>
+void finishProcessor(Processor& processor) {
+  if constexpr (requires { processor.finish(); }) {
+    processor.finish();
+  }
+}
+
+class StageBase {
+public:
+  StageBase(std::string name, StagePlacement placement)
+    : name_(std::move(name)), placement_(std::move(placement)) {}
+  virtual ~StageBase() = default;
+
+  StageBase(const StageBase&) = delete;
+  StageBase& operator=(const StageBase&) = delete;
+
+  void start(const std::atomic<bool>& stop) {
+    thread_ = std::thread([this, &stop] {
+      {
+        ScopedPlacement placed(name_, placement_);
+        started_.store(true, std::memory_order_release);
+        run(stop);
+      }
+      finished_.store(true, std::memory_order_release);
+    });
+  }
+
+  void join() {
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+  bool started() const { return started_.load(std::memory_order_acquire); }
+  bool finished() const { return finished_.load(std::memory_order_acquire); }
+  const std::string& name() const { return name_; }
+  const StageCounters& counters() const { return counters_; }
+
+protected:
+  virtual void run(const std::atomic<bool>& stop) = 0;
+
+  StageCounters counters_;
+
+private:
+  std::string name_;
+  StagePlacement placement_;
+  std::thread thread_;
+  std::atomic<bool> started_{ false };
+  std::atomic<bool> finished_{ false };
+};
+
+template <typename Processor, typename InQueue, typename OutQueue>
+class Stage final : public StageBase {
+  static constexpr bool kIsSource = std::is_same_v<InQueue, NoQueue>;
+  static constexpr bool kIsSink = std::is_same_v<OutQueue, NoQueue>;
+
+public:
+  Stage(std::string name, Processor processor, InQueue* in, OutQueue* out, StagePlacement placement)
+    : StageBase(std::move(name), std::move(placement)), processor_(std::move(processor)), in_(in), out_(out) {}
+
+  Processor& processor() { return processor_; }
+
+protected:
+  void run(const std::atomic<bool>& stop) override {
+    if constexpr (kIsSource) {
+      runSource(stop);
+    } else {
+      runStage();
+    }
+    finishProcessor(processor_);
+    if constexpr (!kIsSource) {
+      in_->close(); // releases the producer if we stopped before it did
+    }
+    if constexpr (!kIsSink) {
+      out_->close();
+    }
+  }
+
+private:
+  void runSource(const std::atomic<bool>& stop) {
+    uint64_t emitted = 0;
+    while (!stop.load(std::memory_order_relaxed)) {
+      auto* out = claimSlot(*out_, &stop);
+      if (!out) {
+        break;
+      }
+      SourceStatus status = processor_(*out);
+      if (status != SourceStatus::Item) {
+        out_->cancel_claim();
+        if (status == SourceStatus::Done) {
+          break;
+        }
+        counters_.idle_waits.fetch_add(1, std::memory_order_relaxed);
+        continue;
+      }
+      out_->commit();
+      counters_.emitted.store(++emitted, std::memory_order_relaxed);
+    }
+  }
+
+  void runStage() {
+    uint64_t received = 0, emitted = 0, dropped = 0, batches = 0;
+    while (true) {
+      // Read closed() first: everything committed before close() is then
+      // visible to available().
+      bool closed = in_->closed();
+      size_t n = std::min(in_->available(), kStageBatchSize);
+      if (n == 0) {
+        if (closed) {
+          break;
+        }
+        counters_.idle_waits.fetch_add(1, std::memory_order_relaxed);
+        in_->wait_available_timeout(std::chrono::milliseconds(100));
+        continue;
+      }
+      for (size_t i = 0; i < n; ++i) {
+        auto& in = *in_->peek(i);
+        if constexpr (kIsSink) {
+          processor_(in);
+        } else {
+          auto* out = claimSlot(*out_);
+          if (!out) {
+            ++dropped; // downstream is gone
+          } else if (processor_(in, *out)) {
+            ++emitted;
+          } else {
+            out_->cancel_claim();
+            ++dropped;
+          }
+        }
+      }
+      in_->release(n);
+      if constexpr (!kIsSink) {
+        out_->commit();
+      }
+      flushProcessor(processor_);
+      received += n;
+      counters_.received.store(received, std::memory_order_relaxed);
+      counters_.emitted.store(emitted, std::memory_order_relaxed);
+      counters_.dropped.store(dropped, std::memory_order_relaxed);
+      counters_.batches.store(++batches, std::memory_order_relaxed);
+    }
+  }
+
+  Processor processor_;
+  InQueue* in_;
+  OutQueue* out_;
+};
+
+template <typename T>
+struct ProcessorTraits : ProcessorTraits<decltype(&T::operator())> {};
+
+template <typename C, typename In, typename Out>
+struct ProcessorTraits<bool (C::*)(In&, Out&)> {
+  using input_type = In;
+  using output_type = Out;
+};
+
+template <typename C, typename In>
+struct ProcessorTraits<void (C::*)(In&)> {
+  using input_type = In;
+  using output_type = void;
+};
+
+// Runs two processors back to back on one thread, handing the intermediate
+// item over on the stack instead of through a ring. Fusing into a sink gives
+// a sink; fusions nest, so Fused<Fused<A, B>, C> is a three-stage fusion.
+template <typename First, typename Second>
+class Fused {
+  using Mid = typename ProcessorTraits<First>::output_type;
+  using Out = typename ProcessorTraits<Second>::output_type;
+
+public:
+  using input_type = typename ProcessorTraits<First>::input_type;
+
+  Fused(First first, Second second) : first_(std::move(first)), second_(std::move(second)) {}
+
+  // Transform when Second is a transform...
+  template <typename O = Out, typename = std::enable_if_t<!std::is_void_v<O>>>
+  bool operator()(input_type& in, O& out) {
+    Mid mid{};
+    return first_(in, mid) && second_(mid, out);
+  }
+
+  // ...and a sink when Second is a sink.
+  template <typename O = Out, typename = std::enable_if_t<std::is_void_v<O>>>
+  void operator()(input_type& in) {
+    Mid mid{};
+    if (first_(in, mid)) {
+      second_(mid);
+    }
+  }
+
+  void flush() {
+    flushProcessor(first_);
+    flushProcessor(second_);
+  }
+
+  void finish() {
+    finishProcessor(first_);
+    finishProcessor(second_);
+  }
+
+  First& first() { return first_; }
+  Second& second() { return second_; }
+
+private:
+  First first_;
+  Second second_;
+};
+
+template <typename First, typename Second>
+struct ProcessorTraits<Fused<First, Second>> {
+  using input_type = typename ProcessorTraits<First>::input_type;
+  using output_type = typename ProcessorTraits<Second>::output_type;
+};
+
+template <typename First, typename Second>
+Fused<First, Second> fuse(First first, Second second) {
+  return Fused<First, Second>(std::move(first), std::move(second));
+}
+
+// Owns the rings and stages of one pipeline. Typical wiring:
+//
+//   Pipeline pipeline;
+//   auto& lines = pipeline.makeQueue<std::string>();
+//   auto& orders = pipeline.makeQueue<OrderMsg>();
+//   pipeline.addSource("reader", Reader{}, lines);
+//   pipeline.addStage("decode", Decoder{}, lines, orders);
+//   pipeline.addSink("match", Matcher{}, orders);
+//   pipeline.start();
+//   ...
+//   pipeline.stop();
+//
+// Placements default to StagePlacement::fromEnv(stage name). Each ring is
+// bound to the NUMA node of the stage that consumes it, and pinned stages
+// busy-spin on the rings they touch.
+class Pipeline {
+public:
+  Pipeline() = default;
+  ~Pipeline() { stop(); }
+
+  Pipeline(const Pipeline&) = delete;
+  Pipeline& operator=(const Pipeline&) = delete;
+
+  template <typename T, typename Queue = StageQueue<T>>
+  Queue& makeQueue() {
+    auto queue = std::make_shared<Queue>();
+    queues_.push_back(queue);
+    return *queue;
+  }
+
+  template <typename Processor, typename OutQueue>
+  Processor& addSource(const std::string& name, Processor processor, OutQueue& out) {
+    return addSource(name, std::move(processor), out, StagePlacement::fromEnv(name));
+  }
+
+  template <typename Processor, typename OutQueue>
+  Processor& addSource(const std::string& name, Processor processor, OutQueue& out, StagePlacement placement) {
+    spinIfPinned(out.producer_wait(), placement);
+    return add<Processor, NoQueue, OutQueue>(name, std::move(processor), nullptr, &out, std::move(placement));
+  }
+
+  template <typename Processor, typename InQueue, typename OutQueue>
+  Processor& addStage(const std::string& name, Processor processor, InQueue& in, OutQueue& out) {
+    return addStage(name, std::move(processor), in, out, StagePlacement::fromEnv(name));
+  }
+
+  template <typename Processor, typename InQueue, typename OutQueue>
+  Processor& addStage(const std::string& name, Processor processor, InQueue& in, OutQueue& out, StagePlacement placement) {
+    bindMemoryToNode(&in, sizeof(in), numaNodeOf(placement));
+    spinIfPinned(in.consumer_wait(), placement);
+    spinIfPinned(out.producer_wait(), placement);
+    return add<Processor, InQueue, OutQueue>(name, std::move(processor), &in, &out, std::move(placement));
+  }
+
+  template <typename Processor, typename InQueue>
+  Processor& addSink(const std::string& name, Processor processor, InQueue& in) {
+    return addSink(name, std::move(processor), in, StagePlacement::fromEnv(name));
+  }
+
+  template <typename Processor, typename InQueue>
+  Processor& addSink(const std::string& name, Processor processor, InQueue& in, StagePlacement placement) {
+    bindMemoryToNode(&in, sizeof(in), numaNodeOf(placement));
+    spinIfPinned(in.consumer_wait(), placement);
+    return add<Processor, InQueue, NoQueue>(name, std::move(processor), &in, nullptr, std::move(placement));
+  }
+
+  void start() {
+    for (auto& stage : stages_) {
+      stage->start(stop_);
+    }
+  }
+
+  // Asks the sources to stop and waits for every stage to drain.
+  void stop() {
+    stop_.store(true, std::memory_order_relaxed);
+    wait();
+  }
+
+  // Waits for the pipeline to drain on its own, e.g. once its sources are done.
+  void wait() {
+    for (auto& stage : stages_) {
+      stage->join();
+    }
+  }
+
+  // Whether every stage thread is up, placed and running its processor.
+  bool running() const {
+    return std::all_of(stages_.begin(), stages_.end(), [](const auto& stage) { return stage->started(); });
+  }
+
+  bool finished() const {
+    return std::all_of(stages_.begin(), stages_.end(), [](const auto& stage) { return stage->finished(); });
+  }
+
+  const std::vector<std::unique_ptr<StageBase>>& stages() const { return stages_; }
+
+  void report(std::ostream& os) const {
+    os << std::left << std::setw(12) << "stage" << std::right
+       << std::setw(12) << "received" << std::setw(12) << "emitted" << std::setw(10) << "dropped"
+       << std::setw(10) << "batches" << std::setw(12) << "idle_waits" << "\n";
+    for (const auto& stage : stages_) {
+      const auto& c = stage->counters();
+      os << std::left << std::setw(12) << stage->name() << std::right
+         << std::setw(12) << c.received.load() << std::setw(12) << c.emitted.load()
+         << std::setw(10) << c.dropped.load() << std::setw(10) << c.batches.load()
+         << std::setw(12) << c.idle_waits.load() << "\n";
+    }
+  }
+
+private:
+  template <typename Processor, typename InQueue, typename OutQueue>
+  Processor& add(const std::string& name, Processor processor, InQueue* in, OutQueue* out, StagePlacement placement) {
+    auto stage = std::make_unique<Stage<Processor, InQueue, OutQueue>>(name, std::move(processor), in, out, std::move(placement));
+    auto& result = stage->processor();
+    stages_.push_back(std::move(stage));
+    return result;
+  }
+
+  std::vector<std::shared_ptr<void>> queues_;
+  std::vector<std::unique_ptr<StageBase>> stages_;
+  std::atomic<bool> stop_{ false };
+};
+
+#endif // PIPELINE_HPP
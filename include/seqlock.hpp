@@ -0,0 +1,82 @@
+#ifndef SEQLOCK_HPP
+#define SEQLOCK_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// Single-writer sequence lock around a trivially copyable value. The writer
+// never waits: it bumps the sequence to odd, stores the value and bumps it
+// back to even. Readers copy the value and retry if the sequence was odd or
+// moved while they were copying, so they always come away with a value that
+// was published as a whole, and never delay the writer.
+//
+// The payload is kept in relaxed atomic words rather than a plain T, so the
+// racing reads are well defined.
+template <typename T>
+class alignas(64) Seqlock {
+  static_assert(std::is_trivially_copyable_v<T>, "Seqlock values are copied bytewise");
+
+public:
+  Seqlock() {
+    store(T{});
+    sequence_.store(0, std::memory_order_relaxed);
+  }
+
+  Seqlock(const Seqlock&) = delete;
+  Seqlock& operator=(const Seqlock&) = delete;
+
+  // Writer side. Only one thread may store.
+  void store(const T& value) {
+    uint64_t words[kWords] = {};
+    std::memcpy(words, &value, sizeof(T));
+    auto seq = sequence_.load(std::memory_order_relaxed);
+    sequence_.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < kWords; ++i) {
+      words_[i].store(words[i], std::memory_order_relaxed);
+    }
+    sequence_.store(seq + 2, std::memory_order_release);
+  }
+
+  // Reader side. Any number of threads.
+  T load() const {
+    T value;
+    while (!try_load(value)) {
+    }
+    return value;
+  }
+
+  // One attempt; false if it overlapped a store.
+  bool try_load(T& value) const {
+    auto before = sequence_.load(std::memory_order_acquire);
+    if (before & 1) {
+      return false;
+    }
+    uint64_t words[kWords];
+    for (size_t i = 0; i < kWords; ++i) {
+      words[i] = words_[i].load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (sequence_.load(std::memory_order_relaxed) != before) {
+      return false;
+    }
+    std::memcpy(&value, words, sizeof(T));
+    return true;
+  }
+
+  // Number of completed stores.
+  uint64_t version() const {
+    return sequence_.load(std::memory_order_acquire) / 2;
+  }
+
+private:
+  static constexpr size_t kWords = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+  std::atomic<uint64_t> sequence_{ 0 };
+  std::atomic<uint64_t> words_[kWords];
+};
+
+#endif // SEQLOCK_HPP
@@ -1,60 +1,66 @@
 #ifndef SPSC_QUEUE_HPP
 #define SPSC_QUEUE_HPP
 
+#include "wait_strategy.hpp"
+
+#include <algorithm>
 #include <atomic>
+#include <cstddef>
 #include <memory>
+#include <new>
 #include <stdexcept>
 #include <array>
 #include <chrono>
 #include <thread>
 
-template <typename T, size_t Capacity>
+// WaitStrategy controls how wait_* calls block (see wait_strategy.hpp).
+// Slots are raw storage: items are constructed on push and destroyed on pop.
+template <typename T, size_t Capacity, typename WaitStrategy = SpinParkWait>
 class SPSCQueue {
 public:
   SPSCQueue() : head_(0), tail_(0) {}
 
-  bool push(const T& value) {
-    auto head = head_.load(std::memory_order_relaxed);
-    auto nextHead = (head + 1) % Capacity;
-    if (nextHead == tail_.load(std::memory_order_acquire)) {
-      return false; // Queue is full
+  ~SPSCQueue() {
+    auto head = (head_.load(std::memory_order_relaxed) + claimed_) % Capacity;
+    for (auto tail = tail_.load(std::memory_order_relaxed); tail != head; tail = (tail + 1) % Capacity) {
+      std::destroy_at(slot(tail));
     }
-    buffer_[head] = value;
-    head_.store(nextHead, std::memory_order_release);
-    head_.notify_one();
-    return true;
   }
 
-  bool push(T&& value) {
+  SPSCQueue(const SPSCQueue&) = delete;
+  SPSCQueue& operator=(const SPSCQueue&) = delete;
+
+  template <typename... Args>
+  bool emplace(Args&&... args) {
     auto head = head_.load(std::memory_order_relaxed);
     auto nextHead = (head + 1) % Capacity;
     if (nextHead == tail_.load(std::memory_order_acquire)) {
       return false; // Queue is full
     }
-    buffer_[head] = std::move(value);
+    ::new (raw_slot(head)) T(std::forward<Args>(args)...);
     head_.store(nextHead, std::memory_order_release);
-    head_.notify_one();
+    not_empty_.notify();
     return true;
   }
 
+  bool push(const T& value) {
+    return emplace(value);
+  }
+
+  bool push(T&& value) {
+    return emplace(std::move(value));
+  }
+
   bool wait_push_timeout(T&& value, const std::chrono::milliseconds& timeout) {
-    auto deadline = std::chrono::steady_clock::now() + timeout;
     auto head = head_.load(std::memory_order_relaxed);
     auto nextHead = (head + 1) % Capacity;
-    while (nextHead == tail_.load(std::memory_order_acquire)) {
-      if (std::chrono::steady_clock::now() >= deadline) {
-        return false;
-      }
-      head_.wait(head, std::memory_order_acquire);
-      head = head_.load(std::memory_order_relaxed);
-      nextHead = (head + 1) % Capacity;
-      if (nextHead == tail_.load(std::memory_order_acquire)) {
-        std::this_thread::sleep_for(std::chrono::microseconds(100));
-      }
+    auto has_room = [&] { return nextHead != tail_.load(std::memory_order_acquire); };
+    if (!not_full_.wait(has_room, wait_clock::now() + timeout)) {
+      return false;
     }
-    buffer_[head] = std::move(value);
+    ::new (raw_slot(head)) T(std::move(value));
     head_.store(nextHead, std::memory_order_release);
-    head_.notify_one();
+    not_empty_.notify();
     return true;
   }
 
@@ -64,50 +70,165 @@ public:
     if (tail == head) {
       return false; // Queue is empty
     }
-    value = std::move(buffer_[tail]);
-    buffer_[tail] = T{};
+    T* item = slot(tail);
+    value = std::move(*item);
+    std::destroy_at(item);
     tail_.store((tail + 1) % Capacity, std::memory_order_release);
-    head_.notify_one();
+    not_full_.notify();
     return true;
   }
 
   bool wait_pop(T& value) {
+    not_empty_.wait([this] { return !empty_for_consumer() || closed(); }, wait_clock::time_point::max());
+    return pop(value);
+  }
+
+  bool wait_pop_timeout(T& value, const std::chrono::milliseconds& timeout) {
+    if (!not_empty_.wait([this] { return !empty_for_consumer() || closed(); }, wait_clock::now() + timeout)) {
+      return false;
+    }
+    return pop(value);
+  }
+
+  // Moves up to count items from the range starting at first into the queue
+  // and publishes them with a single release store. Returns the number taken.
+  template <typename InputIt>
+  size_t push_n(InputIt first, size_t count) {
+    auto head = head_.load(std::memory_order_relaxed);
+    auto tail = tail_.load(std::memory_order_acquire);
+    size_t n = std::min(count, Capacity - 1 - used(head, tail));
+    if (n == 0) {
+      return 0;
+    }
+    for (size_t i = 0; i < n; ++i, ++first) {
+      ::new (raw_slot((head + i) % Capacity)) T(std::move(*first));
+    }
+    head_.store((head + n) % Capacity, std::memory_order_release);
+    not_empty_.notify();
+    return n;
+  }
+
+  // Moves up to max_count items out of the queue into out and frees their
+  // slots with a single release store. Returns the number taken.
+  template <typename OutputIt>
+  size_t pop_n(OutputIt out, size_t max_count) {
     auto tail = tail_.load(std::memory_order_relaxed);
     auto head = head_.load(std::memory_order_acquire);
-    while (tail == head) {
-      head_.wait(head, std::memory_order_acquire);
-      tail = tail_.load(std::memory_order_relaxed);
-      head = head_.load(std::memory_order_acquire);
+    size_t n = std::min(max_count, used(head, tail));
+    if (n == 0) {
+      return 0;
     }
-    value = std::move(buffer_[tail]);
-    buffer_[tail] = T{};
-    tail_.store((tail + 1) % Capacity, std::memory_order_release);
-    head_.notify_one();
-    return true;
+    for (size_t i = 0; i < n; ++i, ++out) {
+      T* item = slot((tail + i) % Capacity);
+      *out = std::move(*item);
+      std::destroy_at(item);
+    }
+    tail_.store((tail + n) % Capacity, std::memory_order_release);
+    not_full_.notify();
+    return n;
   }
 
-  bool wait_pop_timeout(T& value, const std::chrono::milliseconds& timeout) {
-    auto deadline = std::chrono::steady_clock::now() + timeout;
+  template <typename OutputIt>
+  size_t wait_pop_n_timeout(OutputIt out, size_t max_count, const std::chrono::milliseconds& timeout) {
+    if (!not_empty_.wait([this] { return !empty_for_consumer() || closed(); }, wait_clock::now() + timeout)) {
+      return 0;
+    }
+    return pop_n(out, max_count);
+  }
+
+  // Zero-copy producer API: claim() constructs an item directly in the next
+  // free slot and returns it (nullptr when full) so the caller can fill it in
+  // place. Claimed items stay invisible to the consumer until commit(), which
+  // publishes all of them with one release store. cancel_claim() drops the most
+  // recent unpublished claim. Do not mix push/emplace with outstanding claims.
+  template <typename... Args>
+  T* claim(Args&&... args) {
+    auto head = head_.load(std::memory_order_relaxed);
+    auto index = (head + claimed_) % Capacity;
+    if ((index + 1) % Capacity == tail_.load(std::memory_order_acquire)) {
+      return nullptr; // Queue is full
+    }
+    ++claimed_;
+    return ::new (raw_slot(index)) T(std::forward<Args>(args)...);
+  }
+
+  // claim() that waits while the queue is full. Returns nullptr if the
+  // timeout expires or the queue is closed first.
+  template <typename... Args>
+  T* wait_claim_timeout(const std::chrono::milliseconds& timeout, Args&&... args) {
+    if (!not_full_.wait([this] { return !claims_full() || closed(); }, wait_clock::now() + timeout) || closed()) {
+      return nullptr;
+    }
+    return claim(std::forward<Args>(args)...);
+  }
+
+  void cancel_claim() {
+    --claimed_;
+    std::destroy_at(slot((head_.load(std::memory_order_relaxed) + claimed_) % Capacity));
+  }
+
+  void commit() {
+    if (claimed_ == 0) {
+      return;
+    }
+    head_.store((head_.load(std::memory_order_relaxed) + claimed_) % Capacity, std::memory_order_release);
+    claimed_ = 0;
+    not_empty_.notify();
+  }
+
+  // Zero-copy consumer API: peek(i) returns the i-th published item, which may
+  // be processed in place until release(n) destroys the first n items and
+  // frees their slots with one release store.
+  size_t available() const {
+    return used(head_.load(std::memory_order_acquire), tail_.load(std::memory_order_relaxed));
+  }
+
+  size_t wait_available_timeout(const std::chrono::milliseconds& timeout) {
+    not_empty_.wait([this] { return !empty_for_consumer() || closed(); }, wait_clock::now() + timeout);
+    return available();
+  }
+
+  T* front() {
+    return empty_for_consumer() ? nullptr : slot(tail_.load(std::memory_order_relaxed));
+  }
+
+  T* peek(size_t i) {
+    return slot((tail_.load(std::memory_order_relaxed) + i) % Capacity);
+  }
+
+  void release(size_t n = 1) {
     auto tail = tail_.load(std::memory_order_relaxed);
-    auto head = head_.load(std::memory_order_acquire);
-    while (tail == head) {
-      if (std::chrono::steady_clock::now() >= deadline) {
-        return false;
-      }
-      head_.wait(head, std::memory_order_acquire);
-      tail = tail_.load(std::memory_order_relaxed);
-      head = head_.load(std::memory_order_acquire);
-      if (tail == head) {
-        std::this_thread::sleep_for(std::chrono::microseconds(100));
-      }
+    for (size_t i = 0; i < n; ++i) {
+      std::destroy_at(slot((tail + i) % Capacity));
     }
-    value = std::move(buffer_[tail]);
-    buffer_[tail] = T{};
-    tail_.store((tail + 1) % Capacity, std::memory_order_release);
-    head_.notify_one();
-    return true;
+    tail_.store((tail + n) % Capacity, std::memory_order_release);
+    not_full_.notify();
   }
 
+  // End-of-stream marker set by the producer after its last commit. The
+  // consumer is done once it observes closed() and then finds nothing
+  // available. A consumer that stops early closes it too, to release the
+  // producer. Waits on either side return early once the queue is closed.
+  void close() {
+    closed_.store(true, std::memory_order_release);
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+  bool closed() const {
+    return closed_.load(std::memory_order_acquire);
+  }
+
+  // Wakes any parked waiter on either side, e.g. so it can observe shutdown.
+  void wake_all() {
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+  // The strategies the consumer and the producer wait with.
+  WaitStrategy& consumer_wait() { return not_empty_; }
+  WaitStrategy& producer_wait() { return not_full_; }
+
   bool empty() const {
     return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
   }
@@ -121,13 +242,39 @@ public:
   size_t size() const {
     auto head = head_.load(std::memory_order_acquire);
     auto tail = tail_.load(std::memory_order_acquire);
-    return (head >= tail) ? (head - tail) : (Capacity - tail + head);
+    return used(head, tail);
   }
 
 private:
-  std::array<T, Capacity> buffer_;
+  static size_t used(size_t head, size_t tail) {
+    return (head >= tail) ? (head - tail) : (Capacity - tail + head);
+  }
+
+  // Whether the next claim would find the queue full (producer only).
+  bool claims_full() const {
+    auto index = (head_.load(std::memory_order_relaxed) + claimed_) % Capacity;
+    return (index + 1) % Capacity == tail_.load(std::memory_order_acquire);
+  }
+
+  bool empty_for_consumer() const {
+    return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_relaxed);
+  }
+
+  void* raw_slot(size_t index) {
+    return storage_ + index * sizeof(T);
+  }
+
+  T* slot(size_t index) {
+    return std::launder(reinterpret_cast<T*>(raw_slot(index)));
+  }
+
+  alignas(T) std::byte storage_[Capacity * sizeof(T)];
   alignas(64) std::atomic<size_t> head_;
+  size_t claimed_ = 0; // producer-only
+  std::atomic<bool> closed_{ false };
   alignas(64) std::atomic<size_t> tail_;
+  [[no_unique_address]] WaitStrategy not_empty_;
+  [[no_unique_address]] WaitStrategy not_full_;
 };
 
-#endif
\ No newline at end of file
+#endif
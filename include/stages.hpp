@@ -0,0 +1,336 @@
+#ifndef STAGES_HPP
+#define STAGES_HPP
+
+#include "matching_engine.hpp"
+#include "pipeline.hpp"
+
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <poll.h>
+#include <unistd.h>
+
+// Processors for the parse -> decode -> match chain (see pipeline.hpp).
+
+// Source: one line of stdin per item. Done at end of input.
+class ConsoleReader {
+public:
+  SourceStatus operator()(std::string& line) {
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    // Lines already sitting in cin's buffer do not make the fd readable.
+    bool buffered = std::cin.rdbuf()->in_avail() > 0;
+    int ret = buffered ? 1 : poll(&pfd, 1, 500);
+    if (buffered || (ret > 0 && (pfd.revents & (POLLIN | POLLHUP)))) {
+      if (!std::getline(std::cin, line)) {
+        return SourceStatus::Done;
+      }
+      return line.empty() ? SourceStatus::Idle : SourceStatus::Item;
+    }
+    return SourceStatus::Idle;
+  }
+};
+
+// Source: reports Idle until the gate opens, then forwards to the wrapped
+// source. Lets a benchmark start its clock once every stage is running.
+template <typename Source>
+class GatedSource {
+public:
+  GatedSource(Source source, const std::atomic<bool>& open) : source_(std::move(source)), open_(&open) {}
+
+  SourceStatus operator()(std::string& line) {
+    if (!open_->load(std::memory_order_acquire)) {
+      std::this_thread::yield();
+      return SourceStatus::Idle;
+    }
+    return source_(line);
+  }
+
+private:
+  Source source_;
+  const std::atomic<bool>* open_;
+};
+
+// Source: replays a fixed list of messages, then reports Done.
+class VectorSource {
+public:
+  explicit VectorSource(std::vector<std::string> messages) : messages_(std::move(messages)) {}
+
+  SourceStatus operator()(std::string& line) {
+    if (next_ == messages_.size()) {
+      return SourceStatus::Done;
+    }
+    line = messages_[next_++];
+    return SourceStatus::Item;
+  }
+
+private:
+  std::vector<std::string> messages_;
+  size_t next_ = 0;
+};
+
+class Tokenizer {
+public:
+  bool operator()(std::string& message, MatchingEngine::token_t& tokens) {
+    try {
+      if (!engine_.messageToToken(message, tokens)) {
+        std::cerr << "Error processing message: " << message << "\n";
+        return false;
+      }
+      return true;
+    } catch (const std::exception& e) {
+      std::cerr << "Exception in Tokenizer: " << e.what() << " for message: " << message << "\n";
+      return false;
+    }
+  }
+
+private:
+  MatchingEngine engine_;
+};
+
+class Decoder {
+public:
+  bool operator()(MatchingEngine::token_t& tokens, OrderMsg& msg) {
+    int sz = -1;
+    engine_.processTokens(tokens, msg, sz);
+    return sz > 0;
+  }
+
+private:
+  MatchingEngine engine_;
+};
+
+using RetiredQueue = StageQueue<uint64_t>;
+
+// Sink: one engine holding a book per instrument it has seen. Messages are
+// applied per pipeline batch with MatchingEngine::processBatch and their
+// reports logged as one block. Given a retired queue, the ids of finished
+// limit adds are sent back on it; ids that do not fit wait for the next batch.
+class Matcher {
+public:
+  explicit Matcher(RetiredQueue* retired = nullptr)
+    : reports_(std::make_unique<std::vector<ExecutionReport>>()),
+      retired_ids_(std::make_unique<std::vector<uint64_t>>()), retired_(retired) {
+    batch_.reserve(kStageBatchSize);
+    reports_->reserve(kStageBatchSize * 4);
+    engine_.setReportBuffer(reports_.get());
+    if (retired_) {
+      engine_.setRetiredOrderBuffer(retired_ids_.get());
+    }
+  }
+
+  void operator()(OrderMsg& msg) {
+    batch_.push_back(msg);
+  }
+
+  void flush() {
+    engine_.processBatch(batch_);
+    batch_.clear();
+    if (retired_ && !retired_ids_->empty()) {
+      size_t sent = retired_->push_n(retired_ids_->begin(), retired_ids_->size());
+      retired_ids_->erase(retired_ids_->begin(), retired_ids_->begin() + sent);
+    }
+    if (reports_->empty()) {
+      return;
+    }
+    std::ostringstream out;
+    for (size_t i = 0; i < reports_->size(); ++i) {
+      out << (i ? "\n" : "") << (*reports_)[i];
+    }
+    logger.log_out(out.str());
+    reports_->clear();
+  }
+
+private:
+  std::vector<OrderMsg> batch_;
+  // Heap-held so that the engine's pointers survive moving the Matcher.
+  std::unique_ptr<std::vector<ExecutionReport>> reports_;
+  std::unique_ptr<std::vector<uint64_t>> retired_ids_;
+  RetiredQueue* retired_;
+  MatchingEngine engine_;
+};
+
+// Sink: spreads decoded orders over the rings of N matching shards, one
+// shard per instrument. Cancels, modifies and reduces carry no symbol, so the
+// router remembers the instrument of each live limit order. An id may be
+// reused on another shard only once its shard has retired it.
+class ShardRouter {
+public:
+  using ShardQueue = StageQueue<OrderMsg>;
+
+  explicit ShardRouter(std::vector<ShardQueue*> shards, std::vector<RetiredQueue*> retired = {})
+    : shards_(std::move(shards)), retired_(std::move(retired)), pending_(shards_.size(), false) {}
+
+  static size_t shardOf(Symbol symbol, size_t shards) {
+    return static_cast<size_t>((symbol * 0x9E3779B97F4A7C15ull) >> 32) % shards;
+  }
+
+  void operator()(OrderMsg& msg) {
+    if (msg.msg_type == 0 && msg.type != OrderType::Limit) {
+      // Never rests, so nothing will refer to it later.
+    } else if (msg.msg_type == 0) {
+      Route& route = routes_[msg.order.order_id];
+      if (route.outstanding > 0 && shardOf(route.symbol, shards_.size()) != shardOf(msg.symbol, shards_.size())) {
+        std::stringstream ss;
+        ss << "Duplicate order ID: " << msg.order.order_id;
+        logger.log_err(ss.str());
+        return;
+      }
+      if (route.outstanding == 0) {
+        route.symbol = msg.symbol;
+      }
+      ++route.outstanding; // a same-shard duplicate is retired by its engine
+    } else {
+      auto it = routes_.find(msg.order.order_id);
+      if (it == routes_.end()) {
+        std::stringstream ss;
+        ss << "Order not found: " << msg.order.order_id;
+        logger.log_err(ss.str());
+        return;
+      }
+      msg.symbol = it->second.symbol;
+      if (msg.msg_type == 1 && retired_.empty()) {
+        routes_.erase(it);
+      }
+    }
+    size_t shard = shardOf(msg.symbol, shards_.size());
+    auto* slot = claimSlot(*shards_[shard]);
+    if (!slot) {
+      return; // the shard has stopped reading
+    }
+    *slot = msg;
+    pending_[shard] = true;
+  }
+
+  // Publishes everything routed during the batch, one commit per shard, and
+  // forgets the orders the shards have retired since the last batch.
+  void flush() {
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      if (pending_[i]) {
+        shards_[i]->commit();
+        pending_[i] = false;
+      }
+    }
+    for (auto* retired : retired_) {
+      uint64_t ids[kStageBatchSize];
+      while (size_t n = retired->pop_n(ids, kStageBatchSize)) {
+        for (size_t i = 0; i < n; ++i) {
+          auto it = routes_.find(ids[i]);
+          if (it != routes_.end() && --it->second.outstanding == 0) {
+            routes_.erase(it);
+          }
+        }
+      }
+    }
+  }
+
+  void finish() {
+    flush();
+    for (auto* shard : shards_) {
+      shard->close();
+    }
+  }
+
+  // Order ids the router still routes cancels, modifies and reduces for.
+  size_t trackedOrders() const { return routes_.size(); }
+
+private:
+  struct Route {
+    Symbol symbol = 0;
+    uint32_t outstanding = 0; // limit adds not yet retired by their shard
+  };
+
+  std::vector<ShardQueue*> shards_;
+  std::vector<RetiredQueue*> retired_;
+  std::vector<bool> pending_;
+  std::unordered_map<uint64_t, Route> routes_;
+};
+
+// Where the parse -> decode -> match chain is cut into threads.
+enum class Topology {
+  Split,       // tokens | orders | match: one thread per stage
+  FuseDecode,  // tokens+orders | match
+  Fused,       // tokens+orders+match on one thread
+};
+
+inline const char* topologyName(Topology topology) {
+  switch (topology) {
+    case Topology::Split: return "split";
+    case Topology::FuseDecode: return "fuse-decode";
+    case Topology::Fused: return "fused";
+  }
+  return "?";
+}
+
+inline bool parseTopology(const std::string& name, Topology& topology) {
+  for (Topology t : { Topology::Split, Topology::FuseDecode, Topology::Fused }) {
+    if (name == topologyName(t)) {
+      topology = t;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Wires source -> parse -> decode -> sink into the pipeline with the given
+// stage boundaries. The source stage is named "console" whatever it reads,
+// so MM_CPUS_CONSOLE / MM_FIFO_CONSOLE place it. Fused stages take the name
+// of their last member, so placement variables (MM_CPUS_MATCH, ...) keep
+// applying to the thread that ends up running the matcher.
+template <typename Source, typename Sink = Matcher>
+void wireMatchingPipeline(Pipeline& pipeline, Source source, Topology topology, Sink sink = Sink{}) {
+  auto& lines = pipeline.makeQueue<std::string>();
+  pipeline.addSource("console", std::move(source), lines);
+  switch (topology) {
+    case Topology::Split: {
+      auto& tokens = pipeline.makeQueue<MatchingEngine::token_t>();
+      auto& orders = pipeline.makeQueue<OrderMsg>();
+      pipeline.addStage("tokens", Tokenizer{}, lines, tokens);
+      pipeline.addStage("orders", Decoder{}, tokens, orders);
+      pipeline.addSink("match", std::move(sink), orders);
+      break;
+    }
+    case Topology::FuseDecode: {
+      auto& orders = pipeline.makeQueue<OrderMsg>();
+      pipeline.addStage("orders", fuse(Tokenizer{}, Decoder{}), lines, orders);
+      pipeline.addSink("match", std::move(sink), orders);
+      break;
+    }
+    case Topology::Fused:
+      pipeline.addSink("match", fuse(fuse(Tokenizer{}, Decoder{}), std::move(sink)), lines);
+      break;
+  }
+}
+
+// Wires source -> parse+decode+route -> N matching shards. Shard i is named
+// "match<i>" and is pinned to a CPU of its own unless MM_CPUS_MATCH<i> says
+// otherwise (see spreadPlacement).
+template <typename Source>
+void wireShardedPipeline(Pipeline& pipeline, Source source, size_t shards) {
+  auto& lines = pipeline.makeQueue<std::string>();
+  pipeline.addSource("console", std::move(source), lines);
+  std::vector<ShardRouter::ShardQueue*> queues;
+  std::vector<RetiredQueue*> retired;
+  StagePlacement route = StagePlacement::fromEnv("route");
+  for (size_t i = 0; i < shards; ++i) {
+    queues.push_back(&pipeline.makeQueue<OrderMsg>());
+    retired.push_back(&pipeline.makeQueue<uint64_t>());
+    spinIfPinned(queues.back()->producer_wait(), route);
+  }
+  pipeline.addSink("route", fuse(fuse(Tokenizer{}, Decoder{}), ShardRouter(queues, retired)), lines, route);
+  for (size_t i = 0; i < shards; ++i) {
+    std::string name = "match" + std::to_string(i);
+    StagePlacement placement = StagePlacement::fromEnv(name);
+    if (!placement.pinned()) {
+      placement = spreadPlacement(i);
+    }
+    pipeline.addSink(name, Matcher(retired[i]), *queues[i], placement);
+  }
+}
+
+#endif // STAGES_HPP
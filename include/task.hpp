@@ -0,0 +1,216 @@
+#ifndef TASK_HPP
+#define TASK_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Move-only void() callable with small-buffer storage. Callables up to
+// kInlineSize bytes (a lambda capturing a promise, a couple of references and
+// a few arguments) live inside the Task itself, so wrapping and queueing one
+// does not touch the heap. Larger callables fall back to a heap allocation.
+class Task {
+public:
+  static constexpr std::size_t kInlineSize = 56;
+
+  Task() noexcept = default;
+  Task(std::nullptr_t) noexcept {}
+
+  template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+  Task(F&& f) {
+    using Fn = std::decay_t<F>;
+    if constexpr (fitsInline<Fn>()) {
+      ::new (static_cast<void*>(storage_)) Fn(std::forward<F>(f));
+      ops_ = &kInlineOps<Fn>;
+    } else {
+      ::new (static_cast<void*>(storage_)) Fn*(new Fn(std::forward<F>(f)));
+      ops_ = &kHeapOps<Fn>;
+    }
+  }
+
+  Task(Task&& other) noexcept {
+    moveFrom(other);
+  }
+
+  Task& operator=(Task&& other) noexcept {
+    if (this != &other) {
+      reset();
+      moveFrom(other);
+    }
+    return *this;
+  }
+
+  Task& operator=(std::nullptr_t) noexcept {
+    reset();
+    return *this;
+  }
+
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+
+  ~Task() {
+    reset();
+  }
+
+  explicit operator bool() const noexcept { return ops_ != nullptr; }
+
+  void operator()() {
+    ops_->invoke(storage_);
+  }
+
+  void reset() noexcept {
+    if (ops_) {
+      ops_->destroy(storage_);
+      ops_ = nullptr;
+    }
+  }
+
+private:
+  struct Ops {
+    void (*invoke)(void*);
+    void (*move)(void* dst, void* src) noexcept; // move-constructs dst, destroys src
+    void (*destroy)(void*) noexcept;
+  };
+
+  template <typename Fn>
+  static constexpr bool fitsInline() {
+    return sizeof(Fn) <= kInlineSize && alignof(Fn) <= alignof(std::max_align_t) &&
+           std::is_nothrow_move_constructible_v<Fn>;
+  }
+
+  template <typename Fn>
+  static constexpr Ops kInlineOps{
+    [](void* p) { (*std::launder(static_cast<Fn*>(p)))(); },
+    [](void* dst, void* src) noexcept {
+      Fn* from = std::launder(static_cast<Fn*>(src));
+      ::new (dst) Fn(std::move(*from));
+      from->~Fn();
+    },
+    [](void* p) noexcept { std::launder(static_cast<Fn*>(p))->~Fn(); },
+  };
+
+  template <typename Fn>
+  static constexpr Ops kHeapOps{
+    [](void* p) { (**std::launder(static_cast<Fn**>(p)))(); },
+    [](void* dst, void* src) noexcept { ::new (dst) Fn*(*std::launder(static_cast<Fn**>(src))); },
+    [](void* p) noexcept { delete *std::launder(static_cast<Fn**>(p)); },
+  };
+
+  void moveFrom(Task& other) noexcept {
+    if (other.ops_) {
+      other.ops_->move(storage_, other.storage_);
+      ops_ = other.ops_;
+      other.ops_ = nullptr;
+    }
+  }
+
+  alignas(std::max_align_t) std::byte storage_[kInlineSize];
+  const Ops* ops_ = nullptr;
+};
+
+// Per-thread free lists of small fixed-size blocks. Memory freed on a thread
+// is kept for that thread's next allocation of the same size class, so a
+// submitter that allocates and later releases the shared state of each future
+// stops hitting the global allocator after warm-up.
+class BlockCache {
+public:
+  static void* allocate(std::size_t bytes) {
+    std::size_t cls = sizeClass(bytes);
+    if (cls >= kClasses) {
+      return ::operator new(bytes);
+    }
+    auto& lists = local();
+    if (FreeBlock* block = lists.heads[cls]) {
+      lists.heads[cls] = block->next;
+      --lists.counts[cls];
+      return block;
+    }
+    return ::operator new((cls + 1) * kGranule);
+  }
+
+  static void deallocate(void* p, std::size_t bytes) noexcept {
+    std::size_t cls = sizeClass(bytes);
+    if (cls >= kClasses) {
+      ::operator delete(p);
+      return;
+    }
+    auto& lists = local();
+    if (lists.drained || lists.counts[cls] >= kMaxCached) {
+      ::operator delete(p);
+      return;
+    }
+    auto* block = static_cast<FreeBlock*>(p);
+    block->next = lists.heads[cls];
+    lists.heads[cls] = block;
+    ++lists.counts[cls];
+  }
+
+private:
+  static constexpr std::size_t kGranule = 64;
+  static constexpr std::size_t kClasses = 8; // blocks up to 512 bytes
+  static constexpr std::uint32_t kMaxCached = 4096;
+
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  // Trivially destructible so that blocks released during thread teardown,
+  // after the reaper has run, can still see the drained flag.
+  struct Lists {
+    FreeBlock* heads[kClasses];
+    std::uint32_t counts[kClasses];
+    bool drained;
+  };
+
+  struct Reaper {
+    ~Reaper() {
+      auto& lists = local();
+      for (std::size_t cls = 0; cls < kClasses; ++cls) {
+        while (FreeBlock* block = lists.heads[cls]) {
+          lists.heads[cls] = block->next;
+          ::operator delete(block);
+        }
+        lists.counts[cls] = 0;
+      }
+      lists.drained = true;
+    }
+  };
+
+  static std::size_t sizeClass(std::size_t bytes) {
+    return bytes == 0 ? 0 : (bytes - 1) / kGranule;
+  }
+
+  static Lists& local() {
+    thread_local Lists lists{};
+    thread_local Reaper reaper;
+    (void)reaper;
+    return lists;
+  }
+};
+
+template <typename T>
+struct BlockCacheAllocator {
+  using value_type = T;
+
+  BlockCacheAllocator() noexcept = default;
+  template <typename U>
+  BlockCacheAllocator(const BlockCacheAllocator<U>&) noexcept {}
+
+  T* allocate(std::size_t n) {
+    return static_cast<T*>(BlockCache::allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, std::size_t n) noexcept {
+    BlockCache::deallocate(p, n * sizeof(T));
+  }
+
+  template <typename U>
+  bool operator==(const BlockCacheAllocator<U>&) const noexcept { return true; }
+  template <typename U>
+  bool operator!=(const BlockCacheAllocator<U>&) const noexcept { return false; }
+};
+
+#endif // TASK_HPP
@@ -1,7 +1,10 @@
 #ifndef THREAD_POOL
 #define THREAD_POOL
 
-#include "spsc_queue.hpp"
+#include "chase_lev_deque.hpp"
+#include "mpmc_queue.hpp"
+#include "task.hpp"
+#include "wait_strategy.hpp"
 
 #include <functional>
 #include <future>
@@ -10,63 +13,50 @@
 #include <atomic>
 #include <iostream>
 #include <memory>
+#include <algorithm>
+#include <exception>
+#include <tuple>
 
+// Work-stealing thread pool. Each worker owns a Chase-Lev deque: jobs
+// submitted from a worker go to the bottom of its own deque and are popped
+// LIFO while still cache-warm; idle workers steal FIFO from the top of other
+// deques. Jobs submitted from outside the pool go through a shared MPMC
+// injection queue. Workers with nothing to do park until new work arrives.
+//
+// Jobs are small-buffer Tasks stored by value in the deques and the injection
+// queue, so post() does not allocate. push() additionally needs a future; its
+// shared state comes from a per-thread block cache rather than the heap.
 class ThreadPool
 {
-  using Job = std::function<void()>;
+  using Job = Task;
+
+  struct Worker {
+    ChaseLevDeque<Job, 256> deque;
+    std::thread thread;
+  };
 
   std::atomic<bool> m_enabled{ false };
   std::atomic<bool> m_terminating{ false };
   std::size_t m_nthreads;
 
-  std::vector<std::thread> m_pool;
-  SPSCQueue<Job, 1000> m_job;
-
-  struct TaskWrapper {
-    std::shared_ptr<std::packaged_task<void()>> task;
-    std::shared_ptr<std::atomic<bool>> executed;
-
-    TaskWrapper(std::shared_ptr<std::packaged_task<void()>> t)
-      : task(std::move(t)), executed(std::make_shared<std::atomic<bool>>(false)) {}
-
-    TaskWrapper(const TaskWrapper& other) = default;
-    TaskWrapper& operator=(const TaskWrapper& other) = default;
+  std::vector<std::unique_ptr<Worker>> m_workers;
+  MPMCQueue<Job, 1024> m_injector;
+  SpinParkWait m_idle;
 
-    void operator()() {
-      if (!executed->exchange(true)) {
-        (*task)();
-      }
-    }
-  };
+  inline static thread_local ThreadPool* tl_pool = nullptr;
+  inline static thread_local std::size_t tl_index = 0;
 
   void init()
   {
     for (std::size_t i = 0; i < m_nthreads; ++i)
+    {
+      m_workers.push_back(std::make_unique<Worker>());
+    }
+    for (std::size_t i = 0; i < m_workers.size(); ++i)
     {
       try
       {
-        m_pool.emplace_back(
-          std::thread{
-            [this]()
-            {
-              while (m_enabled && !m_terminating)
-              {
-                Job job;
-                if (!m_job.wait_pop_timeout(job, std::chrono::milliseconds(100)))
-                {
-                  continue;
-                }
-                if (job) {
-                  try {
-                    job();
-                  } catch (const std::exception& e) {
-                    std::cerr << "Exception in thread " << std::this_thread::get_id() << ": " << e.what() << "\n";
-                  }
-                }
-              }
-            }
-          }
-        );
+        m_workers[i]->thread = std::thread{ [this, i]() { workerLoop(i); } };
       }
       catch (const std::exception& e)
       {
@@ -77,11 +67,98 @@ class ThreadPool
     }
   }
 
+  void workerLoop(std::size_t index)
+  {
+    tl_pool = this;
+    tl_index = index;
+    Job job;
+    while (m_enabled && !m_terminating)
+    {
+      if (!findJob(index, job))
+      {
+        m_idle.wait([this] { return m_terminating.load(std::memory_order_relaxed) || hasQueuedWork(); },
+                    wait_clock::now() + std::chrono::milliseconds(100));
+        continue;
+      }
+      runJob(job);
+    }
+    tl_pool = nullptr;
+  }
+
+  static void runJob(Job& job)
+  {
+    if (job) {
+      try {
+        job();
+      } catch (const std::exception& e) {
+        std::cerr << "Exception in thread " << std::this_thread::get_id() << ": " << e.what() << "\n";
+      }
+    }
+    job = nullptr;
+  }
+
+  // Own deque first, then the injection queue, then steal from a random victim.
+  bool findJob(std::size_t index, Job& job)
+  {
+    if (index < m_workers.size() && m_workers[index]->deque.pop(job)) {
+      return true;
+    }
+    if (m_injector.pop(job)) {
+      return true;
+    }
+    return steal(index, job);
+  }
+
+  bool steal(std::size_t thief, Job& job)
+  {
+    std::size_t n = m_workers.size();
+    if (n == 0) {
+      return false;
+    }
+    std::size_t start = nextVictim() % n;
+    for (std::size_t i = 0; i < n; ++i) {
+      std::size_t victim = (start + i) % n;
+      if (victim != thief && m_workers[victim]->deque.steal(job)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool hasQueuedWork() const
+  {
+    if (!m_injector.empty()) {
+      return true;
+    }
+    return std::any_of(m_workers.begin(), m_workers.end(), [](const auto& w) { return !w->deque.empty(); });
+  }
+
+  static std::size_t nextVictim()
+  {
+    thread_local std::size_t state = std::hash<std::thread::id>{}(std::this_thread::get_id()) | 1;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+  }
+
+  void submit(Job&& job)
+  {
+    bool local = tl_pool == this && m_workers[tl_index]->deque.push(std::move(job));
+    if (!local) {
+      while (!m_injector.push(std::move(job))) {
+        std::cerr << "ThreadPool: Queue full, size=" << m_injector.size() << "\n";
+        std::this_thread::yield();
+      }
+    }
+    m_idle.notify();
+  }
+
 public:
   explicit ThreadPool(std::size_t nthreads = std::thread::hardware_concurrency(), bool enabled = true)
-    : m_nthreads{ nthreads }, m_enabled{ enabled }, m_terminating{ false }, m_job{}
+    : m_enabled{ enabled }, m_terminating{ false }, m_nthreads{ nthreads }
   {
-    m_pool.reserve(nthreads);
+    m_workers.reserve(nthreads);
     init();
   }
 
@@ -93,6 +170,8 @@ public:
   ThreadPool(ThreadPool const&) = delete;
   ThreadPool& operator=(const ThreadPool& rhs) = delete;
 
+  std::size_t size() const { return m_workers.size(); }
+
   void start()
   {
     m_enabled.store(true);
@@ -110,25 +189,18 @@ public:
   void join() noexcept
   {
     m_terminating.store(true);
-    // Clear queue first
-    Job job;
-    while (m_job.pop(job)) {}
-    // Push one dummy job per thread
-    for (std::size_t i = 0; i < m_nthreads; ++i)
-    {
-      while (!m_job.push([](){})) {
-        std::this_thread::yield();
-      }
-    }
-    // Join all threads
-    for (auto& t : m_pool)
+    m_idle.notify_all();
+    for (auto& w : m_workers)
     {
-      if (t.joinable())
+      if (w->thread.joinable())
       {
-        t.join();
+        w->thread.join();
       }
     }
-    m_pool.clear();
+    // Drop whatever was still queued.
+    Job job;
+    while (m_injector.pop(job)) {}
+    m_workers.clear();
     m_terminating.store(false);
   }
 
@@ -136,18 +208,99 @@ public:
   decltype(auto) push(Callable&& f, Args&&... args)
   {
     using ResultType = std::invoke_result_t<Callable, Args...>;
-    using Packed = std::packaged_task<ResultType()>;
-    auto task = std::make_shared<Packed>([f = std::forward<Callable>(f), args_copy = std::make_tuple(std::forward<Args>(args)...)]() mutable {
-      return std::apply(f, std::move(args_copy));
+    std::promise<ResultType> promise{ std::allocator_arg, BlockCacheAllocator<char>{} };
+    auto future = promise.get_future();
+    submit([promise = std::move(promise), f = std::forward<Callable>(f), args_copy = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+      try {
+        if constexpr (std::is_void_v<ResultType>) {
+          std::apply(f, std::move(args_copy));
+          promise.set_value();
+        } else {
+          promise.set_value(std::apply(f, std::move(args_copy)));
+        }
+      } catch (...) {
+        promise.set_exception(std::current_exception());
+      }
     });
-    auto wrapper = TaskWrapper(task);
-    auto future = task->get_future();
-    while (!m_job.push(wrapper)) {
-      std::cerr << "ThreadPool: Queue full, size=" << m_job.size() << "\n";
-      std::this_thread::yield();
-    }
     return future;
   }
+
+  // Fire-and-forget submission: no future, no shared state, and no heap
+  // allocation as long as the bound callable fits in a Task.
+  template<typename Callable, typename... Args>
+  void post(Callable&& f, Args&&... args)
+  {
+    if constexpr (sizeof...(Args) == 0) {
+      submit(Job{ std::forward<Callable>(f) });
+    } else {
+      submit([f = std::forward<Callable>(f), args_copy = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+        std::apply(f, std::move(args_copy));
+      });
+    }
+  }
+
+  // Calls fn(i) for every i in [begin, end), split into chunks of grain
+  // indices that run on the pool. The caller works on chunks too and returns
+  // once all of them are done; the first exception thrown by fn is rethrown.
+  template<typename Fn>
+  void parallel_for(std::size_t begin, std::size_t end, Fn&& fn, std::size_t grain = 1)
+  {
+    if (begin >= end) {
+      return;
+    }
+    grain = std::max<std::size_t>(grain, 1);
+
+    // Shared with the helper jobs, which may only start after we return; a
+    // late helper finds no chunk left and never touches fn.
+    struct State {
+      std::size_t begin, end, grain, chunks;
+      std::atomic<std::size_t> next{ 0 };
+      std::atomic<std::size_t> done{ 0 };
+      std::atomic<bool> failed{ false };
+      std::exception_ptr error;
+      SpinParkWait finished;
+      void (*body)(void*, std::size_t);
+      void* fn;
+
+      void work() {
+        for (auto c = next.fetch_add(1, std::memory_order_relaxed); c < chunks; c = next.fetch_add(1, std::memory_order_relaxed)) {
+          try {
+            auto lo = begin + c * grain;
+            auto hi = std::min(end, lo + grain);
+            for (auto i = lo; i < hi; ++i) {
+              body(fn, i);
+            }
+          } catch (...) {
+            if (!failed.exchange(true)) {
+              error = std::current_exception();
+            }
+          }
+          if (done.fetch_add(1, std::memory_order_acq_rel) + 1 == chunks) {
+            finished.notify_all();
+          }
+        }
+      }
+    };
+
+    auto state = std::make_shared<State>();
+    state->begin = begin;
+    state->end = end;
+    state->grain = grain;
+    state->chunks = (end - begin + grain - 1) / grain;
+    state->fn = const_cast<void*>(static_cast<const void*>(std::addressof(fn)));
+    state->body = [](void* f, std::size_t i) { (*static_cast<std::remove_reference_t<Fn>*>(f))(i); };
+
+    std::size_t helpers = std::min(state->chunks - 1, m_workers.size());
+    for (std::size_t i = 0; i < helpers; ++i) {
+      submit([state]() { state->work(); });
+    }
+    state->work();
+    state->finished.wait([&] { return state->done.load(std::memory_order_acquire) == state->chunks; },
+                         wait_clock::time_point::max());
+    if (state->error) {
+      std::rethrow_exception(state->error);
+    }
+  }
 };
 
-#endif
\ No newline at end of file
+#endif
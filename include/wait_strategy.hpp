@@ -0,0 +1,177 @@
+#ifndef WAIT_STRATEGY_HPP
+#define WAIT_STRATEGY_HPP
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <thread>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Wait strategies decide what a queue endpoint does while it waits for the
+// other side. Each one exposes
+//
+//   bool wait(Ready ready, time_point deadline);  // true once ready() holds
+//   void notify();                                // called after every publish
+//   void notify_all();
+//
+// BusySpinWait and SpinYieldWait never sleep in the kernel, so notify() is
+// free. SpinParkWait spins for a while and then parks on a futex; notify()
+// only issues the wake syscall when a waiter is actually parked.
+
+using wait_clock = std::chrono::steady_clock;
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield" ::: "memory");
+#endif
+}
+
+class BusySpinWait {
+public:
+  template <typename Ready>
+  bool wait(Ready&& ready, wait_clock::time_point deadline) {
+    for (uint32_t spins = 1; !ready(); ++spins) {
+      // Reading the clock is a vDSO call, so only do it every few hundred spins.
+      if ((spins & 255) == 0 && wait_clock::now() >= deadline) {
+        return ready();
+      }
+      cpu_relax();
+    }
+    return true;
+  }
+
+  void notify() {}
+  void notify_all() {}
+};
+
+class SpinYieldWait {
+public:
+  template <typename Ready>
+  bool wait(Ready&& ready, wait_clock::time_point deadline) {
+    for (uint32_t i = 0; i < kSpins; ++i) {
+      if (ready()) {
+        return true;
+      }
+      cpu_relax();
+    }
+    while (!ready()) {
+      if (wait_clock::now() >= deadline) {
+        return ready();
+      }
+      std::this_thread::yield();
+    }
+    return true;
+  }
+
+  void notify() {}
+  void notify_all() {}
+
+private:
+  static constexpr uint32_t kSpins = 1024;
+};
+
+class SpinParkWait {
+public:
+  template <typename Ready>
+  bool wait(Ready&& ready, wait_clock::time_point deadline) {
+    for (uint32_t i = 0; i < kSpins; ++i) {
+      if (ready()) {
+        return true;
+      }
+      cpu_relax();
+    }
+    while (true) {
+      uint32_t epoch = epoch_.load(std::memory_order_acquire);
+      waiters_.fetch_add(1, std::memory_order_relaxed);
+      // Pairs with the fence in notify(): either we see the published item
+      // here, or the notifier sees our registration and bumps the epoch.
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (ready()) {
+        waiters_.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+      }
+      bool timed_out = !park(epoch, deadline);
+      waiters_.fetch_sub(1, std::memory_order_relaxed);
+      if (ready()) {
+        return true;
+      }
+      if (timed_out) {
+        return false;
+      }
+    }
+  }
+
+  void notify() { wake(1); }
+  void notify_all() { wake(INT_MAX); }
+
+private:
+  static constexpr uint32_t kSpins = 256;
+
+  void wake(int count) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters_.load(std::memory_order_relaxed) == 0) {
+      return;
+    }
+    epoch_.fetch_add(1, std::memory_order_release);
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch_), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+  }
+
+  // Sleeps until the epoch moves away from the observed value or the deadline
+  // passes. Returns false once the deadline has been reached.
+  bool park(uint32_t epoch, wait_clock::time_point deadline) {
+    if (deadline == wait_clock::time_point::max()) {
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch_), FUTEX_WAIT_PRIVATE, epoch, nullptr, nullptr, 0);
+      return true;
+    }
+    auto now = wait_clock::now();
+    if (now >= deadline) {
+      return false;
+    }
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - now).count();
+    timespec timeout{ static_cast<time_t>(ns / 1000000000), static_cast<long>(ns % 1000000000) };
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch_), FUTEX_WAIT_PRIVATE, epoch, &timeout, nullptr, 0);
+    return wait_clock::now() < deadline;
+  }
+
+  alignas(64) std::atomic<uint32_t> epoch_{ 0 };
+  std::atomic<uint32_t> waiters_{ 0 };
+};
+
+// BusySpinWait or SpinParkWait, picked at run time before the endpoints
+// start, for queues whose stages are only placed once the pipeline is wired.
+class PlacementWait {
+public:
+  void set_spin(bool spin) { spin_ = spin; }
+  bool spins() const { return spin_; }
+
+  template <typename Ready>
+  bool wait(Ready&& ready, wait_clock::time_point deadline) {
+    return spin_ ? spin_wait_.wait(ready, deadline) : park_wait_.wait(ready, deadline);
+  }
+
+  void notify() {
+    if (!spin_) {
+      park_wait_.notify();
+    }
+  }
+
+  void notify_all() {
+    if (!spin_) {
+      park_wait_.notify_all();
+    }
+  }
+
+private:
+  bool spin_ = false;
+  BusySpinWait spin_wait_;
+  SpinParkWait park_wait_;
+};
+
+#endif // WAIT_STRATEGY_HPP
@@ -1,10 +1,43 @@
 #include "generators.hpp"
 
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
 
+namespace {
+  void usage(const char* argv0) {
+    std::cerr << "usage: " << argv0 << " [--topology split|fuse-decode|fused]\n"
+              << "       " << argv0 << " --shards <matching threads>\n"
+              << "       " << argv0 << " --bench <input file> [iterations]\n";
+  }
+}
 
-int main() {
- 
-  matching_engine_mt();
+int main(int argc, char** argv) {
+  if (argc >= 3 && std::strcmp(argv[1], "--bench") == 0) {
+    int iterations = argc >= 4 ? std::max(1, std::atoi(argv[3])) : 5;
+    return runTopologyBenchmark(argv[2], iterations);
+  }
+
+  Topology topology = Topology::Split;
+  int shards = 0;
+  if (argc == 3 && std::strcmp(argv[1], "--topology") == 0) {
+    if (!parseTopology(argv[2], topology)) {
+      usage(argv[0]);
+      return 1;
+    }
+  } else if (argc == 3 && std::strcmp(argv[1], "--shards") == 0) {
+    shards = std::atoi(argv[2]);
+    if (shards <= 0) {
+      usage(argv[0]);
+      return 1;
+    }
+  } else if (argc != 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  matching_engine_mt(topology, static_cast<size_t>(shards));
 
   return 0;
-}
\ No newline at end of file
+}
@@ -1,13 +1,99 @@
 #include "matching_engine.hpp"
 #include "logger.hpp"
+#include "market_data.hpp"
 
 #include <iostream>
 #include <sstream>
 #include <algorithm>
+#include <limits>
+#include <new>
+#include <tuple>
 
 // Global logger instance
 Logger logger;
 
+namespace {
+  bool parseQuantity(std::string const& quantity_token, uint64_t& quantity)
+  {
+    if (quantity_token[0] == '-') {
+      std::stringstream ss;
+      ss << "Invalid order: quantity is negative.";
+      logger.log_err(ss.str());
+      return false;
+    }
+    quantity = std::stoull(quantity_token);
+    return true;
+  }
+
+  // Quantity and price fields of an add.
+  bool parseQuantityAndPrice(std::string const& quantity_token, std::string const& price_token,
+                             uint64_t& quantity, double& price)
+  {
+    if (!parseQuantity(quantity_token, quantity)) {
+      return false;
+    }
+    price = std::stod(price_token);
+    if (quantity == 0 || price <= 0) {
+      std::stringstream ss;
+      ss << "Invalid order: quantity=" << quantity << ", price=" << price;
+      logger.log_err(ss.str());
+      return false;
+    }
+    return true;
+  }
+
+  bool parseOrderType(std::string const& token, OrderType& type)
+  {
+    static const std::pair<const char*, OrderType> kNames[] = {
+      { "GTC", OrderType::Limit }, { "IOC", OrderType::IOC }, { "FOK", OrderType::FOK }, { "MKT", OrderType::Market },
+    };
+    for (const auto& [name, value] : kNames) {
+      if (token == name) {
+        type = value;
+        return true;
+      }
+    }
+    return false;
+  }
+}
+
+MatchingEngine::MatchingEngine()
+  : m_arena(std::make_unique<std::pmr::unsynchronized_pool_resource>())
+{
+  instrument(0);
+}
+
+MatchingEngine::~MatchingEngine()
+{
+  if (!m_arena) {
+    return; // moved from
+  }
+  std::pmr::polymorphic_allocator<Book> alloc(m_arena.get());
+  for (Book* book : m_books) {
+    alloc.delete_object(book);
+  }
+}
+
+InstrumentId MatchingEngine::instrument(Symbol symbol)
+{
+  auto [it, inserted] = m_instrumentIds.try_emplace(symbol, static_cast<InstrumentId>(m_books.size()));
+  if (inserted) {
+    std::pmr::polymorphic_allocator<Book> alloc(m_arena.get());
+    m_books.push_back(alloc.new_object<Book>(symbol, m_arena.get()));
+  }
+  return it->second;
+}
+
+bool MatchingEngine::findInstrument(Symbol symbol, InstrumentId& id) const
+{
+  auto it = m_instrumentIds.find(symbol);
+  if (it == m_instrumentIds.end()) {
+    return false;
+  }
+  id = it->second;
+  return true;
+}
+
 bool MatchingEngine::messageToToken(std::string const& message, token_t& tokens)
 {
   if (!parseMessage(message, tokens)) {
@@ -22,26 +108,63 @@ bool MatchingEngine::messageToToken(std::string const& message, token_t& tokens)
 Order MatchingEngine::processTokens(token_t const& tokens, int& msg_type, int& sz)
 {
   Order order;
+  processTokens(tokens, order, msg_type, sz);
+  return order;
+}
+
+void MatchingEngine::processTokens(token_t const& tokens, Order& order, int& msg_type, int& sz)
+{
+  OrderMsg msg{};
+  processTokens(tokens, msg, sz);
+  msg_type = msg.msg_type;
+  if (sz > 0) {
+    order = msg.order;
+  }
+}
+
+void MatchingEngine::processTokens(token_t const& tokens, OrderMsg& msg, int& sz)
+{
+  int& msg_type = msg.msg_type;
+  Order& order = msg.order;
   try {
     msg_type = std::stoi(tokens[0]);
-    if (msg_type == 0 && tokens.size() == 5) {
+    if (msg_type == 0 && tokens.size() >= 5 && tokens.size() <= 7) {
       uint64_t order_id = std::stoull(tokens[1]);
       Side side = (tokens[2] == "0") ? Side::Buy : Side::Sell;
-      if (tokens[3][0] == '-') {
+      OrderType type = OrderType::Limit;
+      if (tokens.size() == 7 && !parseOrderType(tokens[6], type)) {
         std::stringstream ss;
-        ss << "Invalid order: quantity is negative.";
+        ss << "Invalid order: type=" << tokens[6];
         logger.log_err(ss.str());
-        return order;
+        return;
       }
-      uint64_t quantity = std::stoull(tokens[3]);
-      double price = std::stod(tokens[4]);
-      if (quantity == 0 || price <= 0) {
+      uint64_t quantity;
+      double price = 0;
+      if (type == OrderType::Market) {
+        // The price field is ignored.
+        if (!parseQuantity(tokens[3], quantity)) {
+          return;
+        }
+        if (quantity == 0) {
+          std::stringstream ss;
+          ss << "Invalid order: quantity=" << quantity;
+          logger.log_err(ss.str());
+          return;
+        }
+      }
+      else if (!parseQuantityAndPrice(tokens[3], tokens[4], quantity, price)) {
+        return;
+      }
+      Symbol symbol = 0;
+      if (tokens.size() >= 6 && !tokens[5].empty() && !makeSymbol(tokens[5], symbol)) {
         std::stringstream ss;
-        ss << "Invalid order: quantity=" << quantity << ", price=" << price;
+        ss << "Invalid order: symbol=" << tokens[5];
         logger.log_err(ss.str());
-        return order;
+        return;
       }
       sz = static_cast<int>(tokens.size());
+      msg.symbol = symbol;
+      msg.type = type;
       order.order_id = order_id;
       order.side = side;
       order.quantity = quantity;
@@ -52,20 +175,54 @@ Order MatchingEngine::processTokens(token_t const& tokens, int& msg_type, int& s
       sz = static_cast<int>(tokens.size());
       order.order_id = order_id;
     }
+    else if (msg_type == 5 && tokens.size() == 4) {
+      // Unlike an add, a modify may take the quantity to 0, which cancels.
+      uint64_t order_id = std::stoull(tokens[1]);
+      uint64_t quantity;
+      if (!parseQuantity(tokens[2], quantity)) {
+        return;
+      }
+      double price = std::stod(tokens[3]);
+      if (quantity > 0 && price <= 0) {
+        std::stringstream ss;
+        ss << "Invalid modify: quantity=" << quantity << ", price=" << price;
+        logger.log_err(ss.str());
+        return;
+      }
+      sz = static_cast<int>(tokens.size());
+      order.order_id = order_id;
+      order.quantity = quantity;
+      order.price = price;
+    }
+    else if (msg_type == 6 && tokens.size() == 3) {
+      uint64_t order_id = std::stoull(tokens[1]);
+      uint64_t quantity;
+      if (!parseQuantity(tokens[2], quantity)) {
+        return;
+      }
+      if (quantity == 0) {
+        std::stringstream ss;
+        ss << "Invalid reduce: quantity=" << quantity;
+        logger.log_err(ss.str());
+        return;
+      }
+      sz = static_cast<int>(tokens.size());
+      order.order_id = order_id;
+      order.quantity = quantity;
+    }
     else {
       std::stringstream ss;
       ss << "Invalid message format";
       logger.log_err(ss.str());
-      return order;
+      return;
     }
   }
   catch (const std::exception& e) {
     std::stringstream ss;
     ss << "Error processing message" << " (" << e.what() << ")";
     logger.log_err(ss.str());
-    return order;
+    return;
   }
-  return order;
 }
 
 void MatchingEngine::processMessage(std::string const& message) {
@@ -76,19 +233,113 @@ void MatchingEngine::processMessage(std::string const& message) {
   }
 
   int sz = -1;
-  int msg_type = -1;
-
-  Order order = processTokens(tokens, msg_type, sz);
+  OrderMsg msg{};
+  processTokens(tokens, msg, sz);
+  int msg_type = msg.msg_type;
+  const Order& order = msg.order;
 
   if (msg_type == 0 && sz > 0)
   {
-    addOrder(order.order_id, order.quantity, order.price, order.side);
+    addOrder(order.order_id, order.quantity, order.price, order.side, instrument(msg.symbol), msg.type);
   }
   else if (msg_type == 1 && sz > 0)
   {
     cancelOrder(order.order_id);
   }
+  else if (msg_type == 5 && sz > 0)
+  {
+    modifyOrder(order.order_id, order.quantity, order.price);
+  }
+  else if (msg_type == 6 && sz > 0)
+  {
+    reduceOrder(order.order_id, order.quantity);
+  }
+
+}
 
+// Cancels, modifies and reduces land on random ids, so executing one costs a
+// miss on its index slot, another on its order node and a third on the level
+// it rests in, each depending on the last. With a prefetch distance d,
+// processBatch overlaps those misses across messages: while it executes
+// message i it prefetches the index slot of message i+2d, looks up the
+// (by now cached) slot of message i+d to prefetch its order node, and reads
+// the (by now cached) node of message i+1 to prefetch its level. With d = 1
+// that node is the one prefetched in the same iteration, so reading it would
+// stall on the very miss being hidden; the level step is skipped instead.
+// The lookups run against the current book, so they only ever touch live
+// nodes.
+void MatchingEngine::prefetchOrder(const OrderMsg& msg, bool level) const {
+  if (msg.msg_type == 0) {
+    return;
+  }
+  if (const OrderNode* node = m_orderIndex.find(msg.order.order_id)) {
+    __builtin_prefetch(level ? static_cast<const void*>(node->level) : node);
+  }
+}
+
+void MatchingEngine::processBatch(std::span<const OrderMsg> messages) {
+  bool own_reports = m_reports == nullptr;
+  if (own_reports) {
+    m_reports = &m_batchReports;
+  }
+
+  const size_t n = messages.size();
+  const size_t distance = m_prefetchDistance;
+  for (size_t i = 0; i < std::min(2 * distance, n); ++i) {
+    m_orderIndex.prefetch(messages[i].order.order_id);
+  }
+  Symbol last_symbol = 0;
+  InstrumentId last_instrument = kDefaultInstrument;
+  for (size_t i = 0; i < n; ++i) {
+    if (distance) {
+      if (i + 2 * distance < n) {
+        m_orderIndex.prefetch(messages[i + 2 * distance].order.order_id);
+      }
+      if (i + distance < n) {
+        prefetchOrder(messages[i + distance], false);
+      }
+      if (distance >= 2 && i + 1 < n) {
+        prefetchOrder(messages[i + 1], true);
+      }
+    }
+    const OrderMsg& msg = messages[i];
+    if (msg.msg_type == 0 && msg.symbol != last_symbol) {
+      last_symbol = msg.symbol;
+      last_instrument = instrument(msg.symbol);
+    }
+    applyMessage(msg, last_instrument);
+  }
+
+  if (own_reports) {
+    m_reports = nullptr;
+    if (!m_batchReports.empty()) {
+      std::stringstream ss;
+      for (size_t i = 0; i < m_batchReports.size(); ++i) {
+        ss << (i ? "\n" : "") << m_batchReports[i];
+      }
+      logger.log_out(ss.str());
+      m_batchReports.clear();
+    }
+  }
+}
+
+// instrument is only used by adds; the other messages find their order by id.
+void MatchingEngine::applyMessage(const OrderMsg& msg, InstrumentId instrument) {
+  const Order& order = msg.order;
+  switch (msg.msg_type) {
+    case 0:
+      addOrder(order.order_id, order.quantity, order.price, order.side, instrument, msg.type);
+      break;
+    case 1:
+      cancelOrder(order.order_id);
+      break;
+    case 5:
+      modifyOrder(order.order_id, order.quantity, order.price);
+      break;
+    case 6:
+      reduceOrder(order.order_id, order.quantity);
+      break;
+  }
 }
 
 bool MatchingEngine::parseMessage(std::string const& message, std::vector<std::string>& tokens) {
@@ -100,193 +351,475 @@ bool MatchingEngine::parseMessage(std::string const& message, std::vector<std::s
   return !tokens.empty();
 }
 
-void MatchingEngine::addOrder(uint64_t order_id, uint64_t quantity, double price, Side side) {
-  if (m_orderMap.find(order_id) != m_orderMap.end()) {
+// Limit orders rest whatever does not trade on arrival. IOC and market orders
+// drop their remainder, and a FOK order that cannot trade its full size
+// within its limit is dropped without trading at all; none of them ever
+// rests in the book. Whatever they drop is reported as expired.
+void MatchingEngine::addOrder(uint64_t order_id, uint64_t quantity, double price, Side side, InstrumentId instrument,
+                              OrderType type) {
+  if (m_orderIndex.find(order_id)) {
     std::stringstream ss;
     ss << "Duplicate order ID: " << order_id;
     logger.log_err(ss.str());
+    if (type == OrderType::Limit) {
+      retireOrder(order_id);
+    }
+    return;
+  }
+  if (instrument >= m_books.size()) {
+    std::stringstream ss;
+    ss << "Unknown instrument: " << instrument;
+    logger.log_err(ss.str());
+    if (type == OrderType::Limit) {
+      retireOrder(order_id);
+    }
     return;
   }
 
+  Book& book = *m_books[instrument];
+  if (type == OrderType::Limit && !(side == Side::Buy ? crosses(book.asks, price) : crosses(book.bids, price))) {
+    // Passive: nothing to match, straight into the book.
+    addToBook(book, instrument, Order{ order_id, quantity, price, side });
+    publishMarketData();
+    return;
+  }
+  if (type == OrderType::Market) {
+    price = (side == Side::Buy) ? std::numeric_limits<double>::infinity() : -std::numeric_limits<double>::infinity();
+  }
   Order order{ order_id, quantity, price, side };
-  matchOrder(order);
-  if (order.quantity > 0) {
-    addToBook(order);
+  if (side == Side::Buy) {
+    if (type == OrderType::FOK && sumThrough(book.asks, price, quantity) < quantity) {
+      emitExpired(order_id, quantity);
+      return;
+    }
+    matchOrder(order, book.asks, book.ask_hint);
   }
+  else {
+    if (type == OrderType::FOK && sumThrough(book.bids, price, quantity) < quantity) {
+      emitExpired(order_id, quantity);
+      return;
+    }
+    matchOrder(order, book.bids, book.bid_hint);
+  }
+  if (type == OrderType::Limit) {
+    if (order.quantity > 0) {
+      addToBook(book, instrument, order);
+    }
+    else {
+      retireOrder(order_id);
+    }
+  }
+  else if (order.quantity > 0) {
+    emitExpired(order_id, order.quantity);
+  }
+  publishMarketData();
+}
+
+// Total quantity of the levels from the best price through limit, from the
+// point of view of an order trading against them. Stops early once cap is
+// reached, which is all a FOK check needs to know.
+template <typename Levels>
+uint64_t MatchingEngine::sumThrough(const Levels& levels, double limit, uint64_t cap) {
+  uint64_t total = 0;
+  for (const auto& [price, level] : levels) {
+    if (levels.key_comp()(limit, price)) {
+      break;
+    }
+    total += level.quantity;
+    if (total >= cap) {
+      break;
+    }
+  }
+  return total;
+}
+
+template <typename Levels>
+PriceLevel MatchingEngine::levelAt(const Levels& levels, double price) {
+  auto it = levels.find(price);
+  if (it == levels.end()) {
+    return PriceLevel{ price, 0, 0 };
+  }
+  return PriceLevel{ price, it->second.quantity, it->second.count };
+}
+
+PriceLevel MatchingEngine::levelAt(InstrumentId instrument, Side side, double price) const {
+  const Book& book = *m_books[instrument];
+  return (side == Side::Buy) ? levelAt(book.bids, price) : levelAt(book.asks, price);
+}
+
+template <typename Levels>
+size_t MatchingEngine::copyDepth(const Levels& levels, std::span<PriceLevel> out) {
+  size_t n = 0;
+  for (auto it = levels.begin(); it != levels.end() && n < out.size(); ++it, ++n) {
+    out[n] = PriceLevel{ it->first, it->second.quantity, it->second.count };
+  }
+  return n;
+}
+
+size_t MatchingEngine::depth(InstrumentId instrument, Side side, std::span<PriceLevel> out) const {
+  const Book& book = *m_books[instrument];
+  return (side == Side::Buy) ? copyDepth(book.bids, out) : copyDepth(book.asks, out);
+}
+
+uint64_t MatchingEngine::quantityThrough(InstrumentId instrument, Side side, double limit) const {
+  const Book& book = *m_books[instrument];
+  auto cap = std::numeric_limits<uint64_t>::max();
+  return (side == Side::Buy) ? sumThrough(book.bids, limit, cap) : sumThrough(book.asks, limit, cap);
 }
 
 void MatchingEngine::cancelOrder(uint64_t order_id) {
-  auto it = m_orderMap.find(order_id);
-  if (it == m_orderMap.end()) {
+  OrderNode* node = m_orderIndex.find(order_id);
+  if (!node) {
     std::stringstream ss;
     ss << "Order not found: " << order_id;
     logger.log_err(ss.str());
     return;
   }
 
-  const Order& order = it->second;
+  detachOrder(*m_books[node->instrument], node);
+  releaseOrder(node);
+  publishMarketData();
+}
 
-  if (order.side == Side::Buy)
-  {
-    auto& book = m_buyOrderBook;
-    auto price_it = book.find(order.price);
-    if (price_it != book.end()) {
-      auto& orders = price_it->second;
-      orders.erase(std::remove_if(orders.begin(), orders.end(),
-        [order_id](const Order& o) { return o.order_id == order_id; }),
-        orders.end());
-      if (orders.empty()) {
-        book.erase(price_it);
-      }
-    }
-    m_orderMap.erase(it);
+// Takes quantity off a resting order without touching its queue position.
+// Reducing by the whole remaining size (or more) cancels it.
+void MatchingEngine::reduceOrder(uint64_t order_id, uint64_t quantity) {
+  OrderNode* node = m_orderIndex.find(order_id);
+  if (!node) {
+    std::stringstream ss;
+    ss << "Order not found: " << order_id;
+    logger.log_err(ss.str());
+    return;
+  }
+  if (quantity >= node->order.quantity) {
+    detachOrder(*m_books[node->instrument], node);
+    releaseOrder(node);
   }
   else {
-    auto& book = m_sellOrderBook;
-    auto price_it = book.find(order.price);
-    if (price_it != book.end()) {
-      auto& orders = price_it->second;
-      orders.erase(std::remove_if(orders.begin(), orders.end(),
-        [order_id](const Order& o) { return o.order_id == order_id; }),
-        orders.end());
-      if (orders.empty()) {
-        book.erase(price_it);
-      }
-    }
-    m_orderMap.erase(it);
+    noteLevel(node->instrument, node->order.side, node->order.price, node->level);
+    node->order.quantity -= quantity;
+    node->level->quantity -= quantity;
   }
+  publishMarketData();
 }
 
-void MatchingEngine::matchOrder(Order& aggressive_order) {
+// Cancel/replace in place. A pure size decrease keeps the order's place in
+// its queue; a size increase or a new price re-queues it at the back of its
+// (new) level. A new price that crosses trades first, like a new order would.
+void MatchingEngine::modifyOrder(uint64_t order_id, uint64_t quantity, double price) {
+  OrderNode* node = m_orderIndex.find(order_id);
+  if (!node) {
+    std::stringstream ss;
+    ss << "Order not found: " << order_id;
+    logger.log_err(ss.str());
+    return;
+  }
+  if (quantity == 0) {
+    cancelOrder(order_id);
+    return;
+  }
 
-  if (aggressive_order.side == Side::Buy)
-  {
-    auto& opposite_book = m_sellOrderBook;
-    while (aggressive_order.quantity > 0 && !opposite_book.empty()) {
-      auto best_price_it = opposite_book.begin();
-      double best_price = best_price_it->first;
-      bool can_match = (aggressive_order.side == Side::Buy) ?
-        (aggressive_order.price >= best_price) :
-        (aggressive_order.price <= best_price);
-      if (!can_match) {
-        break;
-      }
+  Order& order = node->order;
+  if (price == order.price && quantity <= order.quantity) {
+    noteLevel(node->instrument, order.side, order.price, node->level);
+    node->level->quantity -= order.quantity - quantity;
+    order.quantity = quantity;
+    publishMarketData();
+    return;
+  }
 
-      auto& resting_orders = best_price_it->second;
-      if (resting_orders.empty()) {
-        opposite_book.erase(best_price_it);
-        continue;
-      }
+  Book& book = *m_books[node->instrument];
+  detachOrder(book, node);
+  order.quantity = quantity;
+  order.price = price;
+  if (order.side == Side::Buy) {
+    matchOrder(order, book.asks, book.ask_hint);
+  }
+  else {
+    matchOrder(order, book.bids, book.bid_hint);
+  }
+  if (order.quantity > 0) {
+    linkOrder(book, node);
+  }
+  else {
+    releaseOrder(node);
+  }
+  publishMarketData();
+}
 
-      Order& resting_order = resting_orders.front();
-      uint64_t trade_quantity = std::min(aggressive_order.quantity, resting_order.quantity);
-      double trade_price = resting_order.price;
+// Levels is the opposite side of the aggressor's book. Its ordering puts the
+// best price first, so the aggressor crosses as long as its price is not
+// ordered before the best level's. opposite_hint is that side's insertion
+// hint, reset if the level it points at is emptied.
+template <typename Levels>
+void MatchingEngine::matchOrder(Order& aggressive_order, Levels& opposite_book,
+                                typename Levels::iterator& opposite_hint) {
+  bool verbose = m_fillReporting == FillReporting::Verbose;
+  bool unreported = false; // aggressor filled since its last report
+  while (aggressive_order.quantity > 0 && !opposite_book.empty()) {
+    auto best_price_it = opposite_book.begin();
+    if (opposite_book.key_comp()(aggressive_order.price, best_price_it->first)) {
+      break;
+    }
 
-      emitTradeEvent(trade_quantity, trade_price);
+    Level& level = best_price_it->second;
+    OrderNode* resting = level.head;
+    Order& resting_order = resting->order;
+    uint64_t trade_quantity = std::min(aggressive_order.quantity, resting_order.quantity);
+    double trade_price = resting_order.price;
 
-      aggressive_order.quantity -= trade_quantity;
-      if (aggressive_order.quantity > 0) {
-        emitPartiallyFilled(aggressive_order.order_id, aggressive_order.quantity);
-      }
-      else {
-        emitFullyFilled(aggressive_order.order_id);
-      }
+    emitTradeEvent(trade_quantity, trade_price);
 
-      resting_order.quantity -= trade_quantity;
-      if (resting_order.quantity == 0) {
-        emitFullyFilled(resting_order.order_id);
-        m_orderMap.erase(resting_order.order_id);
-        resting_orders.pop_front();
-        if (resting_orders.empty()) {
-          opposite_book.erase(best_price_it);
+    aggressive_order.quantity -= trade_quantity;
+    if (verbose) {
+      emitOrderStatus(aggressive_order);
+    }
+    else {
+      unreported = true;
+    }
+
+    noteLevel(resting->instrument, resting_order.side, resting_order.price, &level);
+    resting_order.quantity -= trade_quantity;
+    level.quantity -= trade_quantity;
+    if (resting_order.quantity == 0) {
+      emitFullyFilled(resting_order.order_id);
+      unlinkOrder(resting);
+      releaseOrder(resting);
+      if (!level.head) {
+        eraseLevel(opposite_book, opposite_hint, best_price_it);
+        if (unreported && m_fillReporting == FillReporting::PerLevel) {
+          emitOrderStatus(aggressive_order);
+          unreported = false;
         }
       }
-      else {
-        emitPartiallyFilled(resting_order.order_id, resting_order.quantity);
-        m_orderMap[resting_order.order_id].quantity = resting_order.quantity;
-      }
+    }
+    else {
+      emitPartiallyFilled(resting_order.order_id, resting_order.quantity);
     }
   }
-  else
-  {
-    auto& opposite_book = m_buyOrderBook;
-    while (aggressive_order.quantity > 0 && !opposite_book.empty()) {
-      auto best_price_it = opposite_book.begin();
-      double best_price = best_price_it->first;
-      bool can_match = (aggressive_order.side == Side::Buy) ?
-        (aggressive_order.price >= best_price) :
-        (aggressive_order.price <= best_price);
-      if (!can_match) {
-        break;
-      }
+  if (unreported) {
+    emitOrderStatus(aggressive_order);
+  }
+}
 
-      auto& resting_orders = best_price_it->second;
-      if (resting_orders.empty()) {
-        opposite_book.erase(best_price_it);
-        continue;
-      }
+// Whether an order at price would trade against the opposite side. The map
+// keeps its first node cached, so this is O(1).
+template <typename Levels>
+bool MatchingEngine::crosses(const Levels& opposite_book, double price) {
+  return !opposite_book.empty() && !opposite_book.key_comp()(price, opposite_book.begin()->first);
+}
 
-      Order& resting_order = resting_orders.front();
-      uint64_t trade_quantity = std::min(aggressive_order.quantity, resting_order.quantity);
-      double trade_price = resting_order.price;
+template <typename Levels>
+void MatchingEngine::eraseLevel(Levels& levels, typename Levels::iterator& hint, typename Levels::iterator it) {
+  if (hint == it) {
+    hint = levels.end();
+  }
+  levels.erase(it);
+}
 
-      emitTradeEvent(trade_quantity, trade_price);
+void MatchingEngine::addToBook(Book& book, InstrumentId instrument, const Order& order) {
+  std::pmr::polymorphic_allocator<OrderNode> alloc(m_arena.get());
+  OrderNode* node = alloc.allocate(1);
+  ::new (node) OrderNode{ order, nullptr, nullptr, nullptr, instrument };
+  linkOrder(book, node);
+  m_orderIndex.insert(order.order_id, node);
+}
 
-      aggressive_order.quantity -= trade_quantity;
-      if (aggressive_order.quantity > 0) {
-        emitPartiallyFilled(aggressive_order.order_id, aggressive_order.quantity);
+// Appends the node to the back of the level at its price.
+void MatchingEngine::linkOrder(Book& book, OrderNode* node) {
+  const Order& order = node->order;
+  auto levelFor = [&](auto& levels, auto& hint) -> Level& {
+    bool created = false;
+    if (hint == levels.end() || hint->first != order.price) {
+      std::tie(hint, created) = levels.try_emplace(order.price);
+    }
+    noteLevel(node->instrument, order.side, order.price, created ? nullptr : &hint->second);
+    return hint->second;
+  };
+  Level& level = (order.side == Side::Buy) ? levelFor(book.bids, book.bid_hint) : levelFor(book.asks, book.ask_hint);
+  node->level = &level;
+  node->prev = level.tail;
+  node->next = nullptr;
+  if (level.tail) {
+    level.tail->next = node;
+  }
+  else {
+    level.head = node;
+  }
+  level.tail = node;
+  level.quantity += order.quantity;
+  ++level.count;
+}
+
+void MatchingEngine::unlinkOrder(OrderNode* node) {
+  Level& level = *node->level;
+  noteLevel(node->instrument, node->order.side, node->order.price, &level);
+  (node->prev ? node->prev->next : level.head) = node->next;
+  (node->next ? node->next->prev : level.tail) = node->prev;
+  level.quantity -= node->order.quantity;
+  --level.count;
+}
+
+// Unlinks the node and drops its level if that leaves the level empty.
+void MatchingEngine::detachOrder(Book& book, OrderNode* node) {
+  unlinkOrder(node);
+  if (!node->level->head) {
+    if (node->order.side == Side::Buy) {
+      eraseLevel(book.bids, book.bid_hint, book.bids.find(node->order.price));
+    }
+    else {
+      eraseLevel(book.asks, book.ask_hint, book.asks.find(node->order.price));
+    }
+  }
+}
+
+// Drops a node that is no longer linked into a level.
+void MatchingEngine::releaseOrder(OrderNode* node) {
+  m_orderIndex.erase(node->order.order_id);
+  retireOrder(node->order.order_id);
+  std::pmr::polymorphic_allocator<OrderNode> alloc(m_arena.get());
+  alloc.deallocate(node, 1);
+}
+
+void MatchingEngine::retireOrder(uint64_t order_id) {
+  if (m_retired) {
+    m_retired->push_back(order_id);
+  }
+}
+
+// Remembers the state a level had before the current message first changed
+// it; level is null if the message is creating it.
+void MatchingEngine::noteLevel(InstrumentId instrument, Side side, double price, const Level* level) {
+  if (!m_levelUpdates && !m_bboPublisher && !m_bookViewPublisher) {
+    return;
+  }
+  for (const TouchedLevel& touched : m_touchedLevels) {
+    if (touched.price == price && touched.side == side && touched.instrument == instrument) {
+      return;
+    }
+  }
+  m_touchedLevels.push_back(TouchedLevel{ instrument, side, price, level != nullptr,
+                                          level ? level->quantity : 0, level ? level->count : 0 });
+}
+
+// Called once at the end of every message. Compares each level the message
+// touched with its state before the message, so a sweep that fills many
+// orders on one level reports that level once, and a level that was created
+// and emptied again within the message reports nothing. Then refreshes the
+// BBO and book view of every instrument involved.
+void MatchingEngine::publishMarketData() {
+  if (m_touchedLevels.empty()) {
+    return;
+  }
+  if (m_levelUpdates) {
+    publishLevelUpdates();
+  }
+  if (m_bboPublisher || m_bookViewPublisher) {
+    for (size_t i = 0; i < m_touchedLevels.size(); ++i) {
+      InstrumentId instrument = m_touchedLevels[i].instrument;
+      bool seen = std::any_of(m_touchedLevels.begin(), m_touchedLevels.begin() + i,
+                              [instrument](const TouchedLevel& t) { return t.instrument == instrument; });
+      if (seen) {
+        continue;
       }
-      else {
-        emitFullyFilled(aggressive_order.order_id);
+      if (m_bboPublisher) {
+        m_bboPublisher->publish(instrument, bestBidOffer(*m_books[instrument]));
       }
-
-      resting_order.quantity -= trade_quantity;
-      if (resting_order.quantity == 0) {
-        emitFullyFilled(resting_order.order_id);
-        m_orderMap.erase(resting_order.order_id);
-        resting_orders.pop_front();
-        if (resting_orders.empty()) {
-          opposite_book.erase(best_price_it);
-        }
+      if (m_bookViewPublisher) {
+        BookView view{};
+        snapshot(instrument, view.depth);
+        m_bookViewPublisher->publish(instrument, view);
       }
-      else {
-        emitPartiallyFilled(resting_order.order_id, resting_order.quantity);
-        m_orderMap[resting_order.order_id].quantity = resting_order.quantity;
+    }
+  }
+  m_touchedLevels.clear();
+}
+
+void MatchingEngine::publishLevelUpdates() {
+  for (const TouchedLevel& touched : m_touchedLevels) {
+    const Book& book = *m_books[touched.instrument];
+    PriceLevel now = (touched.side == Side::Buy) ? levelAt(book.bids, touched.price) : levelAt(book.asks, touched.price);
+    LevelAction action;
+    if (now.count == 0) {
+      if (!touched.existed) {
+        continue;
       }
+      action = LevelAction::Remove;
+    }
+    else if (!touched.existed) {
+      action = LevelAction::Add;
+    }
+    else if (now.quantity != touched.quantity || now.count != touched.count) {
+      action = LevelAction::Change;
+    }
+    else {
+      continue;
     }
+    m_levelUpdates->push_back(LevelUpdate{ touched.instrument, touched.side, action, touched.price, now.quantity, now.count });
   }
 }
 
-void MatchingEngine::addToBook(const Order& order) {
-  if (order.side == Side::Buy)
-  {
-    auto& book = m_buyOrderBook;
-    book[order.price].push_back(order);
-    m_orderMap[order.order_id] = order;
+Bbo MatchingEngine::bestBidOffer(const Book& book) {
+  Bbo bbo;
+  if (!book.bids.empty()) {
+    bbo.bid_price = book.bids.begin()->first;
+    bbo.bid_quantity = book.bids.begin()->second.quantity;
   }
-  else
-  {
-    auto& book = m_sellOrderBook;
-    book[order.price].push_back(order);
-    m_orderMap[order.order_id] = order;
+  if (!book.asks.empty()) {
+    bbo.ask_price = book.asks.begin()->first;
+    bbo.ask_quantity = book.asks.begin()->second.quantity;
   }
+  return bbo;
+}
 
+std::ostream& operator<<(std::ostream& os, const ExecutionReport& report) {
+  switch (report.type) {
+    case ReportType::Trade:
+      return os << "2," << report.quantity << "," << report.price;
+    case ReportType::FullyFilled:
+      return os << "3," << report.order_id;
+    case ReportType::PartiallyFilled:
+      return os << "4," << report.order_id << "," << report.quantity;
+    case ReportType::Expired:
+      return os << "7," << report.order_id << "," << report.quantity;
+  }
+  return os;
 }
 
-void MatchingEngine::emitTradeEvent(uint64_t quantity, double price) {
+// Appends to the caller's report buffer when one is set, otherwise writes
+// the report line through the logger.
+void MatchingEngine::emit(const ExecutionReport& report) {
+  if (m_reports) {
+    m_reports->push_back(report);
+    return;
+  }
   std::stringstream ss;
-  ss << "2," << quantity << "," << price;
+  ss << report;
   logger.log_out(ss.str());
 }
 
+void MatchingEngine::emitTradeEvent(uint64_t quantity, double price) {
+  emit(ExecutionReport{ ReportType::Trade, 0, quantity, price });
+}
+
 void MatchingEngine::emitFullyFilled(uint64_t order_id) {
-  std::stringstream ss;
-  ss << "3," << order_id;
-  logger.log_out(ss.str());
+  emit(ExecutionReport{ ReportType::FullyFilled, order_id, 0, 0 });
+}
+
+// Fully or partially filled, depending on what is left of the order.
+void MatchingEngine::emitOrderStatus(const Order& order) {
+  if (order.quantity > 0) {
+    emitPartiallyFilled(order.order_id, order.quantity);
+  }
+  else {
+    emitFullyFilled(order.order_id);
+  }
 }
 
 void MatchingEngine::emitPartiallyFilled(uint64_t order_id, uint64_t quantity) {
-  std::stringstream ss;
-  ss << "4," << order_id << "," << quantity;
-  logger.log_out(ss.str());
-}
\ No newline at end of file
+  emit(ExecutionReport{ ReportType::PartiallyFilled, order_id, quantity, 0 });
+}
+
+void MatchingEngine::emitExpired(uint64_t order_id, uint64_t quantity) {
+  emit(ExecutionReport{ ReportType::Expired, order_id, quantity, 0 });
+}
@@ -1,11 +1,27 @@
 #include <gtest/gtest.h>
 
+#include "affinity.hpp"
 #include "matching_engine.hpp"
 #include "logger.hpp"
+#include "market_data.hpp"
+#include "spsc_queue.hpp"
+#include "mpmc_queue.hpp"
+#include "order_index.hpp"
+#include "pipeline.hpp"
+#include "seqlock.hpp"
+#include "stages.hpp"
+#include "thread_pool.hpp"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <fstream>
+#include <random>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 namespace {
 
@@ -28894,6 +28910,857 @@ TEST_F(MatchingEngineTest, NegativePrice) {
   // Check stderr output
 }
 
+TEST_F(MatchingEngineTest, MultipleInstruments) {
+  MatchingEngine engine;
+  engine.processMessage("0,1,0,10,100,AAPL");
+  engine.processMessage("0,2,1,10,90,MSFT");   // would cross AAPL, but is another book
+  engine.processMessage("0,3,1,4,95");         // default instrument
+  engine.processMessage("0,1,1,5,100,MSFT");   // duplicate id across books
+  engine.processMessage("1,2");                // cancel finds the MSFT book
+  engine.processMessage("0,4,1,3,100,AAPL");
+  EXPECT_EQ(output_stream.str(), "2,3,100\n3,4\n4,1,7\n");
+
+  InstrumentId aapl;
+  Symbol symbol;
+  ASSERT_TRUE(makeSymbol("AAPL", symbol));
+  ASSERT_TRUE(engine.findInstrument(symbol, aapl));
+  EXPECT_EQ(engine.symbolOf(aapl), symbol);
+  EXPECT_EQ(engine.instrumentCount(), 3u);
+  EXPECT_EQ(engine.restingOrderCount(), 2u);  // 1 and 3
+}
+
+TEST_F(MatchingEngineTest, ModifyPriorityRules) {
+  MatchingEngine engine;
+  engine.processMessage("0,1,1,10,100");
+  engine.processMessage("0,2,1,10,100");
+  engine.processMessage("5,1,5,100");    // size down: 1 stays ahead of 2
+  engine.processMessage("0,3,0,3,100");
+  engine.processMessage("5,1,8,100");    // size up: 1 goes behind 2
+  engine.processMessage("0,4,0,4,100");
+  engine.processMessage("5,2,6,99");     // new price: back of the 99 level
+  engine.processMessage("0,5,0,1,97");
+  engine.processMessage("5,5,1,101");    // repriced through the spread: trades
+  engine.processMessage("5,9,1,1");      // unknown order
+  engine.processMessage("0,6,0,2,90");
+  engine.processMessage("5,6,0,90");     // to zero: cancelled
+  engine.processMessage("5,2,3,-1");     // bad price: rejected
+  EXPECT_EQ(output_stream.str(),
+            "2,3,100\n3,3\n4,1,2\n"
+            "2,4,100\n3,4\n4,2,6\n"
+            "2,1,99\n3,5\n4,2,5\n");
+  EXPECT_EQ(engine.restingOrderCount(), 2u);
+}
+
+TEST_F(MatchingEngineTest, ReduceKeepsPriority) {
+  MatchingEngine engine;
+  engine.processMessage("0,1,1,10,100");
+  engine.processMessage("0,2,1,10,100");
+  engine.processMessage("6,1,7");        // 1 keeps its place with 3 left
+  engine.processMessage("0,3,0,4,100");
+  engine.processMessage("6,2,20");       // more than remains: cancelled
+  engine.processMessage("0,4,0,1,100");  // nothing left to trade with
+  EXPECT_EQ(output_stream.str(), "2,3,100\n4,3,1\n3,1\n2,1,100\n3,3\n4,2,9\n");
+  EXPECT_EQ(engine.restingOrderCount(), 1u);
+}
+
+TEST_F(MatchingEngineTest, ImmediateOrderTypes) {
+  MatchingEngine engine;
+  engine.processMessage("0,1,1,5,100");
+  engine.processMessage("0,2,1,5,101");
+  engine.processMessage("0,3,0,8,100,,IOC");   // 5 trade, 3 expire
+  engine.processMessage("0,4,0,6,101,,FOK");   // only 5 available: all 6 expire
+  engine.processMessage("0,5,0,4,101,,FOK");
+  engine.processMessage("0,6,1,3,100");
+  engine.processMessage("0,7,0,9,0,,MKT");     // takes 3 @ 100 and 1 @ 101, 5 expire
+  engine.processMessage("0,8,0,1,1,,BAD");
+  engine.processMessage("0,9,1,2,1,,IOC");     // nothing to trade with: all 2 expire
+  EXPECT_EQ(output_stream.str(),
+            "2,5,100\n4,3,3\n3,1\n7,3,3\n"
+            "7,4,6\n"
+            "2,4,101\n3,5\n4,2,1\n"
+            "2,3,100\n4,7,6\n3,6\n2,1,101\n4,7,5\n3,2\n7,7,5\n"
+            "7,9,2\n");
+  EXPECT_EQ(engine.restingOrderCount(), 0u);
+}
+
+TEST_F(MatchingEngineTest, LevelAggregates) {
+  MatchingEngine engine;
+  engine.processMessage("0,1,1,10,100");
+  engine.processMessage("0,2,1,20,100");
+  engine.processMessage("0,3,1,5,101");
+  engine.processMessage("0,4,0,7,99");
+  engine.processMessage("0,5,0,4,100");  // fills 4 of order 1
+  engine.processMessage("6,2,5");        // reduce
+  engine.processMessage("5,3,8,100");    // modify onto the 100 level
+  engine.processMessage("1,1");
+
+  PriceLevel level = engine.levelAt(kDefaultInstrument, Side::Sell, 100);
+  EXPECT_EQ(level.quantity, 15u + 8u);
+  EXPECT_EQ(level.count, 2u);
+  EXPECT_EQ(engine.levelAt(kDefaultInstrument, Side::Sell, 101).count, 0u);
+  EXPECT_EQ(engine.levelAt(kDefaultInstrument, Side::Buy, 99).quantity, 7u);
+  EXPECT_EQ(engine.quantityThrough(kDefaultInstrument, Side::Sell, 100), 23u);
+  EXPECT_EQ(engine.quantityThrough(kDefaultInstrument, Side::Sell, 99.5), 0u);
+  EXPECT_EQ(engine.quantityThrough(kDefaultInstrument, Side::Buy, 90), 7u);
+}
+
+TEST_F(MatchingEngineTest, DepthSnapshot) {
+  MatchingEngine engine;
+  engine.processMessage("0,1,0,10,99");
+  engine.processMessage("0,2,0,5,98");
+  engine.processMessage("0,3,0,1,99");
+  engine.processMessage("0,4,0,2,97");
+  engine.processMessage("0,5,1,3,101");
+
+  BookDepth<2> top;
+  engine.snapshot(kDefaultInstrument, top);
+  ASSERT_EQ(top.bid_levels, 2u);
+  EXPECT_EQ(top.bids[0].price, 99);
+  EXPECT_EQ(top.bids[0].quantity, 11u);
+  EXPECT_EQ(top.bids[0].count, 2u);
+  EXPECT_EQ(top.bids[1].price, 98);
+  ASSERT_EQ(top.ask_levels, 1u);
+  EXPECT_EQ(top.asks[0].quantity, 3u);
+
+  std::array<PriceLevel, 10> bids;
+  EXPECT_EQ(engine.depth(kDefaultInstrument, Side::Buy, bids), 3u);
+  EXPECT_EQ(bids[2].price, 97);
+}
+
+TEST_F(MatchingEngineTest, LevelUpdateFeed) {
+  MatchingEngine engine;
+  std::vector<LevelUpdate> updates;
+  engine.setLevelUpdateBuffer(&updates);
+  engine.processMessage("0,1,1,5,100");
+  engine.processMessage("0,2,1,5,101");
+  engine.processMessage("0,3,1,5,101");
+  ASSERT_EQ(updates.size(), 3u);
+  EXPECT_EQ(updates[0].action, LevelAction::Add);
+  EXPECT_EQ(updates[2].action, LevelAction::Change);
+  EXPECT_EQ(updates[2].quantity, 10u);
+  EXPECT_EQ(updates[2].count, 2u);
+  updates.clear();
+
+  // One sweep: three fills, one update per level, plus the resting remainder.
+  engine.processMessage("0,4,0,16,101");
+  ASSERT_EQ(updates.size(), 3u);
+  EXPECT_EQ(updates[0].side, Side::Sell);
+  EXPECT_EQ(updates[0].price, 100);
+  EXPECT_EQ(updates[0].action, LevelAction::Remove);
+  EXPECT_EQ(updates[1].price, 101);
+  EXPECT_EQ(updates[1].action, LevelAction::Remove);
+  EXPECT_EQ(updates[2].side, Side::Buy);
+  EXPECT_EQ(updates[2].action, LevelAction::Add);
+  EXPECT_EQ(updates[2].quantity, 1u);
+  updates.clear();
+
+  engine.processMessage("0,5,1,1,101,,IOC");  // empties the bid, never rests
+  engine.processMessage("1,99");              // rejected: no update
+  ASSERT_EQ(updates.size(), 1u);
+  EXPECT_EQ(updates[0].side, Side::Buy);
+  EXPECT_EQ(updates[0].action, LevelAction::Remove);
+  EXPECT_EQ(updates[0].price, 101);
+}
+
+TEST_F(MatchingEngineTest, BboPublisherConflates) {
+  MatchingEngine engine;
+  BboPublisher publisher(4);
+  engine.setBboPublisher(&publisher);
+  Bbo bbo;
+  EXPECT_FALSE(publisher.read(kDefaultInstrument, bbo));
+
+  engine.processMessage("0,1,0,10,99");
+  engine.processMessage("0,2,1,5,101");
+  engine.processMessage("0,3,0,10,98");   // below the best bid: quote unchanged
+  ASSERT_TRUE(publisher.read(kDefaultInstrument, bbo));
+  EXPECT_EQ(bbo.sequence, 2u);
+  EXPECT_EQ(bbo.bid_price, 99);
+  EXPECT_EQ(bbo.bid_quantity, 10u);
+  EXPECT_EQ(bbo.ask_price, 101);
+  EXPECT_EQ(bbo.ask_quantity, 5u);
+
+  engine.processMessage("0,4,1,10,99");   // takes the whole best bid
+  ASSERT_TRUE(publisher.read(kDefaultInstrument, bbo));
+  EXPECT_EQ(bbo.sequence, 3u);
+  EXPECT_EQ(bbo.bid_price, 98);
+
+  engine.processMessage("0,5,0,1,50,ZZZ");
+  InstrumentId zzz;
+  Symbol symbol;
+  ASSERT_TRUE(makeSymbol("ZZZ", symbol));
+  ASSERT_TRUE(engine.findInstrument(symbol, zzz));
+  ASSERT_TRUE(publisher.read(zzz, bbo));
+  EXPECT_EQ(bbo.ask_quantity, 0u);
+}
+
+TEST(BookViewTest, ConcurrentReaderSeesConsistentBook) {
+  MatchingEngine engine;
+  BookViewPublisher views(1);
+  engine.setBookViewPublisher(&views);
+
+  // The writer keeps each bid level at 10 * its price in size; any torn read
+  // would break that relation or the price ordering.
+  std::atomic<bool> done{ false };
+  std::jthread writer([&] {
+    uint64_t id = 1;
+    for (int round = 0; round < 2000; ++round) {
+      double price = 1 + round % 20;
+      engine.addOrder(id++, static_cast<uint64_t>(price) * 10, price, Side::Buy);
+      if (round % 3 == 0) {
+        engine.cancelOrder(id - 1);
+      }
+    }
+    done = true;
+  });
+  BookView view;
+  while (!done) {
+    if (!views.read(kDefaultInstrument, view)) {
+      continue;
+    }
+    for (size_t i = 0; i < view.depth.bid_levels; ++i) {
+      const PriceLevel& level = view.depth.bids[i];
+      ASSERT_EQ(level.quantity, static_cast<uint64_t>(level.price) * 10 * level.count);
+      if (i > 0) {
+        ASSERT_LT(level.price, view.depth.bids[i - 1].price);
+      }
+    }
+  }
+  writer.join();
+
+  ASSERT_TRUE(views.read(kDefaultInstrument, view));
+  EXPECT_EQ(view.depth.bid_levels, kBookViewDepth);
+  EXPECT_EQ(view.depth.bids[0].price, 20);
+  uint64_t quantity = 0;
+  EXPECT_TRUE(views.quantityAt(kDefaultInstrument, Side::Buy, 20, quantity));
+  EXPECT_EQ(quantity, engine.levelAt(kDefaultInstrument, Side::Buy, 20).quantity);
+  EXPECT_FALSE(views.quantityAt(kDefaultInstrument, Side::Buy, 2, quantity));
+  EXPECT_TRUE(views.quantityAt(kDefaultInstrument, Side::Sell, 5, quantity));
+  EXPECT_EQ(quantity, 0u);
+}
+
+TEST(SeqlockTest, ReadersSeeWholeValues) {
+  struct Pair {
+    uint64_t a, b, c;
+  };
+  Seqlock<Pair> lock;
+  std::atomic<bool> done{ false };
+  std::jthread writer([&] {
+    for (uint64_t i = 1; i <= 200000; ++i) {
+      lock.store(Pair{ i, i * 2, i * 3 });
+    }
+    done = true;
+  });
+  uint64_t last = 0;
+  while (!done) {
+    Pair p = lock.load();
+    ASSERT_EQ(p.b, p.a * 2);
+    ASSERT_EQ(p.c, p.a * 3);
+    ASSERT_GE(p.a, last);
+    last = p.a;
+  }
+  writer.join();
+  EXPECT_EQ(lock.load().a, 200000u);
+  EXPECT_EQ(lock.version(), 200000u);
+}
+
+TEST_F(MatchingEngineTest, CoalescedSweepFills) {
+  const char* book[] = { "0,1,1,2,100", "0,2,1,2,100", "0,3,1,2,101", "0,4,1,5,101" };
+  std::string expected[] = {
+    // Verbose: the aggressor after every fill.
+    "2,2,100\n4,9,7\n3,1\n2,2,100\n4,9,5\n3,2\n2,2,101\n4,9,3\n3,3\n2,3,101\n3,9\n4,4,2\n",
+    // PerLevel: once after 100 is emptied, once when the order is done.
+    "2,2,100\n3,1\n2,2,100\n3,2\n4,9,5\n2,2,101\n3,3\n2,3,101\n4,4,2\n3,9\n",
+    // PerMessage: once.
+    "2,2,100\n3,1\n2,2,100\n3,2\n2,2,101\n3,3\n2,3,101\n4,4,2\n3,9\n",
+  };
+  FillReporting modes[] = { FillReporting::Verbose, FillReporting::PerLevel, FillReporting::PerMessage };
+  for (int i = 0; i < 3; ++i) {
+    output_stream.str("");
+    MatchingEngine engine;
+    engine.setFillReporting(modes[i]);
+    for (const char* message : book) {
+      engine.processMessage(message);
+    }
+    engine.processMessage("0,9,0,9,101");
+    EXPECT_EQ(output_stream.str(), expected[i]) << "mode " << i;
+  }
+}
+
+TEST_F(MatchingEngineTest, ReportBufferCollectsTypedReports) {
+  MatchingEngine engine;
+  std::vector<ExecutionReport> reports;
+  engine.setReportBuffer(&reports);
+  engine.addOrder(1, 5, 100, Side::Sell);
+  engine.addOrder(2, 3, 100, Side::Buy);
+  EXPECT_EQ(output_stream.str(), "");
+  ASSERT_EQ(reports.size(), 3u);
+  EXPECT_EQ(reports[0].type, ReportType::Trade);
+  EXPECT_EQ(reports[0].quantity, 3u);
+  EXPECT_EQ(reports[0].price, 100);
+  EXPECT_EQ(reports[1].type, ReportType::FullyFilled);
+  EXPECT_EQ(reports[1].order_id, 2u);
+  EXPECT_EQ(reports[2].type, ReportType::PartiallyFilled);
+  EXPECT_EQ(reports[2].order_id, 1u);
+  EXPECT_EQ(reports[2].quantity, 2u);
+
+  std::stringstream text;
+  for (const auto& report : reports) {
+    text << report << "\n";
+  }
+  EXPECT_EQ(text.str(), "2,3,100\n3,2\n4,1,2\n");
+
+  // A cleared buffer is reused; without one the engine writes lines again.
+  reports.clear();
+  engine.reduceOrder(1, 1);
+  engine.setReportBuffer(nullptr);
+  engine.addOrder(3, 1, 100, Side::Buy);
+  EXPECT_TRUE(reports.empty());
+  EXPECT_EQ(output_stream.str(), "2,1,100\n3,3\n3,1\n");
+}
+
+TEST_F(MatchingEngineTest, BatchMatchesOneAtATime) {
+  std::mt19937_64 rng(11);
+  Symbol aaa = 0, bbb = 0;
+  ASSERT_TRUE(makeSymbol("AAA", aaa) && makeSymbol("BBB", bbb));
+  std::vector<OrderMsg> messages;
+  for (uint64_t id = 1; id <= 2000; ++id) {
+    OrderMsg msg{};
+    msg.msg_type = (id > 10 && rng() % 3 == 0) ? 1 : 0;
+    msg.order.order_id = msg.msg_type == 1 ? 1 + rng() % id : id;
+    msg.order.side = rng() % 2 ? Side::Buy : Side::Sell;
+    msg.order.quantity = 1 + rng() % 10;
+    msg.order.price = 95 + static_cast<double>(rng() % 10);
+    msg.symbol = rng() % 4 ? aaa : bbb;
+    messages.push_back(msg);
+  }
+
+  MatchingEngine single;
+  for (const OrderMsg& msg : messages) {
+    if (msg.msg_type == 0) {
+      single.addOrder(msg.order.order_id, msg.order.quantity, msg.order.price, msg.order.side,
+                      single.instrument(msg.symbol));
+    } else {
+      single.cancelOrder(msg.order.order_id);
+    }
+  }
+  std::string expected = output_stream.str();
+
+  // Prefetching must not change results, whatever the distance.
+  for (size_t distance : { 0, 1, 4, 16 }) {
+    output_stream.str("");
+    MatchingEngine batched;
+    batched.setPrefetchDistance(distance);
+    std::span<const OrderMsg> all(messages);
+    for (size_t i = 0; i < all.size(); i += 37) {
+      batched.processBatch(all.subspan(i, std::min<size_t>(37, all.size() - i)));
+    }
+    EXPECT_EQ(output_stream.str(), expected) << "distance " << distance;
+    EXPECT_EQ(batched.restingOrderCount(), single.restingOrderCount());
+  }
+}
+
+TEST_F(MatchingEngineTest, PassiveAddsAfterLevelIsEmptied) {
+  MatchingEngine engine;
+  engine.addOrder(1, 5, 100, Side::Buy);
+  engine.addOrder(2, 5, 100, Side::Buy);
+  engine.addOrder(3, 10, 100, Side::Sell); // empties the hinted bid level
+  engine.addOrder(4, 3, 100, Side::Buy);   // crosses nothing: rests again
+  engine.addOrder(5, 2, 100, Side::Buy);
+  engine.cancelOrder(4);
+  engine.cancelOrder(5);                   // and again, via cancel
+  engine.addOrder(6, 7, 100, Side::Buy);
+  EXPECT_EQ(engine.levelAt(kDefaultInstrument, Side::Buy, 100).quantity, 7u);
+  EXPECT_EQ(engine.levelAt(kDefaultInstrument, Side::Buy, 100).count, 1u);
+  EXPECT_EQ(engine.restingOrderCount(), 1u);
+
+  engine.addOrder(7, 4, 99, Side::Sell);
+  EXPECT_EQ(output_stream.str(), "2,5,100\n4,3,5\n3,1\n2,5,100\n3,3\n3,2\n2,4,100\n3,7\n4,6,3\n");
+}
+
+TEST(OrderIndexTest, MatchesReferenceMap) {
+  OrderIndex<int*> index(16);
+  std::unordered_map<uint64_t, int*> reference;
+  std::vector<int> values(4096);
+  std::mt19937_64 rng(7);
+  for (int step = 0; step < 100000; ++step) {
+    uint64_t id = rng() % 3000;
+    if (rng() % 3 == 0) {
+      EXPECT_EQ(index.erase(id), reference.erase(id) == 1);
+    } else {
+      int* handle = &values[id];
+      EXPECT_EQ(index.insert(id, handle), reference.emplace(id, handle).second);
+    }
+    uint64_t probe = rng() % 3000;
+    auto it = reference.find(probe);
+    EXPECT_EQ(index.find(probe), it == reference.end() ? nullptr : it->second);
+  }
+  EXPECT_EQ(index.size(), reference.size());
+}
+
+TEST(SPSCQueueTest, BatchPushPop) {
+  SPSCQueue<int, 8> queue;
+  std::vector<int> in = { 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+  EXPECT_EQ(queue.push_n(in.begin(), in.size()), 7u);  // one slot stays free
+  EXPECT_TRUE(queue.full());
+
+  std::vector<int> out(4);
+  EXPECT_EQ(queue.pop_n(out.begin(), out.size()), 4u);
+  EXPECT_EQ(out, std::vector<int>({ 1, 2, 3, 4 }));
+
+  EXPECT_EQ(queue.push_n(in.begin() + 7, 2), 2u);  // wraps around
+  out.assign(8, 0);
+  EXPECT_EQ(queue.pop_n(out.begin(), out.size()), 5u);
+  EXPECT_EQ(std::vector<int>(out.begin(), out.begin() + 5), std::vector<int>({ 5, 6, 7, 8, 9 }));
+  EXPECT_TRUE(queue.empty());
+}
+
+struct CountedItem {
+  static inline int constructed = 0;
+  static inline int destroyed = 0;
+  int value = 0;
+  CountedItem() { ++constructed; }
+  explicit CountedItem(int v) : value(v) { ++constructed; }
+  CountedItem(CountedItem&& other) noexcept : value(other.value) { ++constructed; }
+  CountedItem& operator=(CountedItem&& other) noexcept { value = other.value; return *this; }
+  ~CountedItem() { ++destroyed; }
+};
+
+TEST(SPSCQueueTest, RawStorageLifetime) {
+  CountedItem::constructed = CountedItem::destroyed = 0;
+  {
+    SPSCQueue<CountedItem, 16> queue;
+    EXPECT_EQ(CountedItem::constructed, 0);  // idle slots are never constructed
+
+    EXPECT_TRUE(queue.emplace(7));
+    EXPECT_TRUE(queue.emplace(8));
+    EXPECT_EQ(CountedItem::constructed, 2);
+
+    CountedItem out;
+    EXPECT_TRUE(queue.pop(out));
+    EXPECT_EQ(out.value, 7);
+    EXPECT_EQ(CountedItem::destroyed, 1);  // popped slot destroyed in place
+  }
+  EXPECT_EQ(CountedItem::constructed, CountedItem::destroyed);  // leftovers destroyed with the queue
+}
+
+TEST(SPSCQueueTest, ClaimCommitPeekRelease) {
+  SPSCQueue<std::pair<Order, int>, 4> queue;
+  auto* first = queue.claim();
+  ASSERT_NE(first, nullptr);
+  first->first.order_id = 1;
+  first->second = 0;
+  auto* dropped = queue.claim();
+  ASSERT_NE(dropped, nullptr);
+  queue.cancel_claim();
+  auto* second = queue.claim();
+  ASSERT_NE(second, nullptr);
+  second->first.order_id = 2;
+  second->second = 1;
+  ASSERT_NE(queue.claim(), nullptr);
+  EXPECT_EQ(queue.claim(), nullptr);  // three claims fill a four-slot ring
+  queue.cancel_claim();
+
+  EXPECT_EQ(queue.front(), nullptr);  // nothing visible before commit
+  queue.commit();
+  ASSERT_EQ(queue.available(), 2u);
+  EXPECT_EQ(queue.front()->first.order_id, 1u);
+  EXPECT_EQ(queue.peek(1)->first.order_id, 2u);
+  EXPECT_EQ(queue.peek(1)->second, 1);
+  queue.release(2);
+  EXPECT_TRUE(queue.empty());
+}
+
+TEST(PipelineTest, PinnedStagesSpinOnTheirQueues) {
+  Pipeline pipeline;
+  auto& lines = pipeline.makeQueue<std::string>();
+  auto& orders = pipeline.makeQueue<OrderMsg>();
+  StagePlacement pinned;
+  pinned.cpus = { 0 };
+  pipeline.addSource("console", VectorSource({}), lines, StagePlacement{});
+  pipeline.addStage("orders", fuse(Tokenizer{}, Decoder{}), lines, orders, pinned);
+  pipeline.addSink("match", Matcher{}, orders, StagePlacement{});
+  EXPECT_FALSE(lines.producer_wait().spins());
+  EXPECT_TRUE(lines.consumer_wait().spins());
+  EXPECT_TRUE(orders.producer_wait().spins());
+  EXPECT_FALSE(orders.consumer_wait().spins());
+}
+
+TEST(PipelineTest, ClaimSlotGivesUpWhenConsumerIsGone) {
+  SPSCQueue<int, 4> queue;
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_NE(claimSlot(queue), nullptr);
+  }
+  std::atomic<bool> stop{ true };
+  EXPECT_EQ(claimSlot(queue, &stop), nullptr);  // full and asked to stop
+  EXPECT_EQ(queue.available(), 3u);             // the claims were published
+
+  std::thread consumer([&queue] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    queue.close();
+  });
+  EXPECT_EQ(claimSlot(queue), nullptr);  // full until the consumer closes it
+  consumer.join();
+}
+
+template <typename WaitStrategy>
+void runWaitStrategyPingPong() {
+  SPSCQueue<int, 256, WaitStrategy> queue;
+  int value = 0;
+  EXPECT_FALSE(queue.wait_pop_timeout(value, std::chrono::milliseconds(1)));
+
+  // Assert only once the producer is joined; a stuck consumer tells it to quit.
+  constexpr int kCount = 10000;
+  std::atomic<bool> stuck{ false };
+  std::thread producer([&queue, &stuck] {
+    for (int i = 1; i <= kCount; ++i) {
+      while (!queue.wait_push_timeout(int(i), std::chrono::milliseconds(100))) {
+        if (stuck) {
+          return;
+        }
+      }
+    }
+  });
+  long long sum = 0;
+  for (int i = 1; i <= kCount; ++i) {
+    if (!queue.wait_pop_timeout(value, std::chrono::seconds(5))) {
+      stuck = true;
+      break;
+    }
+    EXPECT_EQ(value, i);
+    sum += value;
+  }
+  producer.join();
+  ASSERT_FALSE(stuck);
+  EXPECT_EQ(sum, static_cast<long long>(kCount) * (kCount + 1) / 2);
+}
+
+TEST(SPSCQueueTest, WaitStrategies) {
+  runWaitStrategyPingPong<BusySpinWait>();
+  runWaitStrategyPingPong<SpinYieldWait>();
+  runWaitStrategyPingPong<SpinParkWait>();
+}
+
+TEST(MPMCQueueTest, ManyProducersManyConsumers) {
+  MPMCQueue<int, 64> queue;
+  int value = 0;
+  EXPECT_FALSE(queue.pop(value));
+  EXPECT_FALSE(queue.wait_pop_timeout(value, std::chrono::milliseconds(1)));
+
+  constexpr int kThreads = 4;
+  constexpr int kPerProducer = 5000;
+  std::atomic<long long> sum{ 0 };
+  std::atomic<int> popped{ 0 };
+  std::vector<std::thread> threads;
+  for (int p = 0; p < kThreads; ++p) {
+    threads.emplace_back([&queue] {
+      for (int i = 1; i <= kPerProducer; ++i) {
+        while (!queue.wait_push_timeout(int(i), std::chrono::milliseconds(100))) {}
+      }
+    });
+  }
+  for (int c = 0; c < kThreads; ++c) {
+    threads.emplace_back([&] {
+      int item = 0;
+      while (popped.load() < kThreads * kPerProducer) {
+        if (queue.wait_pop_timeout(item, std::chrono::milliseconds(10))) {
+          sum += item;
+          ++popped;
+        }
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(popped.load(), kThreads * kPerProducer);
+  EXPECT_EQ(sum.load(), static_cast<long long>(kThreads) * kPerProducer * (kPerProducer + 1) / 2);
+  EXPECT_TRUE(queue.empty());
+}
+
+TEST(ThreadPoolTest, ConcurrentSubmitters) {
+  ThreadPool pool{ 4 };
+  constexpr int kSubmitters = 4;
+  constexpr int kTasks = 500;
+  std::atomic<long long> sum{ 0 };
+  std::vector<std::vector<std::future<void>>> futures(kSubmitters);
+  std::vector<std::thread> submitters;
+  for (int s = 0; s < kSubmitters; ++s) {
+    submitters.emplace_back([&pool, &futures, &sum, s] {
+      for (int i = 0; i < kTasks; ++i) {
+        futures[s].push_back(pool.push([&sum](int x) { sum += x; }, i));
+      }
+    });
+  }
+  for (auto& t : submitters) {
+    t.join();
+  }
+  for (auto& per_submitter : futures) {
+    for (auto& f : per_submitter) {
+      f.get();
+    }
+  }
+  EXPECT_EQ(sum.load(), static_cast<long long>(kSubmitters) * kTasks * (kTasks - 1) / 2);
+}
+
+TEST(ThreadPoolTest, NestedSubmissionAndResults) {
+  ThreadPool pool{ 3 };
+  // Jobs pushed from inside a worker land on its own deque and get stolen by the others.
+  auto outer = pool.push([&pool] {
+    std::vector<std::future<int>> inner;
+    for (int i = 0; i < 200; ++i) {
+      inner.push_back(pool.push([](int x) { return x * x; }, i));
+    }
+    long long total = 0;
+    for (auto& f : inner) {
+      total += f.get();
+    }
+    return total;
+  });
+  EXPECT_EQ(outer.get(), 199LL * 200 * 399 / 6);
+}
+
+TEST(ThreadPoolTest, ParallelFor) {
+  ThreadPool pool{ 4 };
+  std::vector<int> hits(10007, 0);
+  pool.parallel_for(0, hits.size(), [&hits](std::size_t i) { hits[i] += 1; }, 64);
+  EXPECT_EQ(std::count(hits.begin(), hits.end(), 1), static_cast<long>(hits.size()));
+
+  EXPECT_THROW(pool.parallel_for(0, 100, [](std::size_t i) {
+    if (i == 42) {
+      throw std::runtime_error("boom");
+    }
+  }), std::runtime_error);
+}
+
+TEST(ThreadPoolTest, TaskStorage) {
+  int calls = 0;
+  Task small([&calls] { ++calls; });
+  std::array<char, 200> big_payload{};
+  big_payload[0] = 2;
+  Task big([&calls, big_payload] { calls += big_payload[0]; });  // falls back to the heap
+
+  Task moved = std::move(small);
+  EXPECT_FALSE(small);
+  moved();
+  big();
+  EXPECT_EQ(calls, 3);
+  moved = nullptr;
+  EXPECT_FALSE(moved);
+}
+
+TEST(ThreadPoolTest, PostAndFutureExceptions) {
+  ThreadPool pool{ 2 };
+  std::atomic<int> posted{ 0 };
+  for (int i = 0; i < 1000; ++i) {
+    pool.post([&posted](int x) { posted += x; }, 1);
+  }
+  auto failing = pool.push([]() -> int { throw std::runtime_error("task failed"); });
+  EXPECT_THROW(failing.get(), std::runtime_error);
+  while (posted.load() != 1000) {
+    std::this_thread::yield();
+  }
+  EXPECT_EQ(posted.load(), 1000);
+}
+
+TEST(AffinityTest, ParseCpuList) {
+  EXPECT_EQ(StagePlacement::parseCpuList("3"), std::vector<int>({ 3 }));
+  EXPECT_EQ(StagePlacement::parseCpuList("0-2,8,10-11"), std::vector<int>({ 0, 1, 2, 8, 10, 11 }));
+  EXPECT_TRUE(StagePlacement::parseCpuList("").empty());
+  EXPECT_FALSE(StagePlacement{}.pinned());
+}
+
+TEST(AffinityTest, ScopedPlacementRestoresThread) {
+  std::thread worker([] {
+    cpu_set_t before;
+    ASSERT_EQ(pthread_getaffinity_np(pthread_self(), sizeof(before), &before), 0);
+    StagePlacement placement = spreadPlacement(0);
+    ASSERT_TRUE(placement.pinned());
+    {
+      ScopedPlacement placed("test", placement);
+      EXPECT_EQ(sched_getcpu(), placement.cpus.front());
+    }
+    cpu_set_t after;
+    ASSERT_EQ(pthread_getaffinity_np(pthread_self(), sizeof(after), &after), 0);
+    EXPECT_TRUE(CPU_EQUAL(&before, &after));
+  });
+  worker.join();
+}
+
+struct CollectingSink {
+  std::vector<OrderMsg>* out;
+  void operator()(OrderMsg& msg) { out->push_back(msg); }
+};
+
+TEST(PipelineTest, ParseDecodeDrain) {
+  logger.set_enabled(false);
+  std::vector<OrderMsg> received;
+  Pipeline pipeline;
+  auto& lines = pipeline.makeQueue<std::string>();
+  auto& tokens = pipeline.makeQueue<MatchingEngine::token_t>();
+  auto& orders = pipeline.makeQueue<OrderMsg>();
+  pipeline.addSource("source", VectorSource({ "0,1,0,10,100.5", "BAD,MESSAGE", "1,1", "0,2,1,5,99" }), lines, StagePlacement{});
+  pipeline.addStage("tokens", Tokenizer{}, lines, tokens, StagePlacement{});
+  pipeline.addStage("orders", Decoder{}, tokens, orders, StagePlacement{});
+  pipeline.addSink("sink", CollectingSink{ &received }, orders, StagePlacement{});
+  pipeline.start();
+  pipeline.wait();  // the source reports Done, everything drains without stop()
+  logger.set_enabled(true);
+
+  ASSERT_TRUE(pipeline.finished());
+  ASSERT_EQ(received.size(), 3u);
+  EXPECT_EQ(received[0].msg_type, 0);
+  EXPECT_EQ(received[0].order.order_id, 1u);
+  EXPECT_EQ(received[0].order.price, 100.5);
+  EXPECT_EQ(received[1].msg_type, 1);
+  EXPECT_EQ(received[2].order.side, Side::Sell);
+  const auto& decode = pipeline.stages()[2]->counters();
+  EXPECT_EQ(decode.received.load(), 4u);
+  EXPECT_EQ(decode.dropped.load(), 1u);
+}
+
+TEST(PipelineTest, FusedStagesMatchSplit) {
+  logger.set_enabled(false);
+  std::vector<OrderMsg> received;
+  Pipeline pipeline;
+  auto& lines = pipeline.makeQueue<std::string>();
+  pipeline.addSource("source", VectorSource({ "0,1,0,10,100.5", "BAD,MESSAGE", "1,1", "0,2,1,5,99" }), lines, StagePlacement{});
+  pipeline.addSink("match", fuse(fuse(Tokenizer{}, Decoder{}), CollectingSink{ &received }), lines, StagePlacement{});
+  pipeline.start();
+  pipeline.wait();
+  logger.set_enabled(true);
+
+  ASSERT_EQ(received.size(), 3u);
+  EXPECT_EQ(received[0].order.order_id, 1u);
+  EXPECT_EQ(received[1].msg_type, 1);
+  EXPECT_EQ(received[2].order.order_id, 2u);
+}
+
+TEST(PipelineTest, GatedSourceWaitsForTheGate) {
+  std::vector<OrderMsg> received;
+  std::atomic<bool> go{ false };
+  Pipeline pipeline;
+  auto& lines = pipeline.makeQueue<std::string>();
+  pipeline.addSource("console", GatedSource(VectorSource({ "0,1,0,10,100", "1,1" }), go), lines, StagePlacement{});
+  pipeline.addSink("match", fuse(fuse(Tokenizer{}, Decoder{}), CollectingSink{ &received }), lines, StagePlacement{});
+  pipeline.start();
+  while (!pipeline.running()) {
+    std::this_thread::yield();
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  EXPECT_EQ(pipeline.stages()[0]->counters().emitted.load(), 0u);
+  go = true;
+  pipeline.wait();
+  EXPECT_EQ(received.size(), 2u);
+}
+
+TEST(ShardRouterTest, RoutesBooksAndCancelsToOneShard) {
+  logger.set_enabled(false);
+  std::vector<OrderMsg> shard_msgs[2];
+  Pipeline pipeline;
+  auto& lines = pipeline.makeQueue<std::string>();
+  auto& q0 = pipeline.makeQueue<OrderMsg>();
+  auto& q1 = pipeline.makeQueue<OrderMsg>();
+  pipeline.addSource("source", VectorSource({ "0,1,0,10,100,AAPL", "0,2,1,5,99,MSFT", "0,3,0,7,101,AAPL",
+                                              "0,4,1,1,50,IBM", "1,2", "1,99", "0,1,1,3,100,MSFT",
+                                              "0,5,0,1,1,TOOLONGSYM", "0,6,0,2,100" }),
+                     lines, StagePlacement{});
+  pipeline.addSink("route", fuse(fuse(Tokenizer{}, Decoder{}), ShardRouter({ &q0, &q1 })), lines, StagePlacement{});
+  pipeline.addSink("match0", CollectingSink{ &shard_msgs[0] }, q0, StagePlacement{});
+  pipeline.addSink("match1", CollectingSink{ &shard_msgs[1] }, q1, StagePlacement{});
+  pipeline.start();
+  pipeline.wait();
+  logger.set_enabled(true);
+
+  std::vector<uint64_t> ids;
+  for (size_t shard = 0; shard < 2; ++shard) {
+    for (const auto& msg : shard_msgs[shard]) {
+      EXPECT_EQ(ShardRouter::shardOf(msg.symbol, 2), shard);
+    }
+  }
+  // Unknown cancel (99), the bad symbol and the duplicate of AAPL's live
+  // order 1 on MSFT's shard are dropped.
+  EXPECT_EQ(shard_msgs[0].size() + shard_msgs[1].size(), 6u);
+
+  Symbol aapl, msft;
+  ASSERT_TRUE(makeSymbol("AAPL", aapl));
+  ASSERT_TRUE(makeSymbol("MSFT", msft));
+  EXPECT_EQ(symbolName(aapl), "AAPL");
+  const auto& aapl_shard = shard_msgs[ShardRouter::shardOf(aapl, 2)];
+  std::vector<uint64_t> aapl_ids;
+  for (const auto& msg : aapl_shard) {
+    if (msg.symbol == aapl) {
+      aapl_ids.push_back(msg.order.order_id);
+    }
+  }
+  EXPECT_EQ(aapl_ids, (std::vector<uint64_t>{ 1, 3 }));
+  const auto& msft_shard = shard_msgs[ShardRouter::shardOf(msft, 2)];
+  auto cancel = std::find_if(msft_shard.begin(), msft_shard.end(), [](const OrderMsg& m) { return m.msg_type == 1; });
+  ASSERT_NE(cancel, msft_shard.end());
+  EXPECT_EQ(cancel->order.order_id, 2u);
+  EXPECT_EQ(cancel->symbol, msft);
+}
+
+TEST(ShardRouterTest, ForgetsRetiredOrdersAndAllowsReuse) {
+  std::stringstream out, err;
+  logger.set_enabled(false);
+  logger.set_out_stream(&out, &err);
+  constexpr size_t kShards = 2;
+  Pipeline pipeline;  // only owns the rings; router and shards run on this thread
+  std::vector<ShardRouter::ShardQueue*> queues;
+  std::vector<RetiredQueue*> retired;
+  std::vector<Matcher> shards;
+  for (size_t i = 0; i < kShards; ++i) {
+    queues.push_back(&pipeline.makeQueue<OrderMsg>());
+    retired.push_back(&pipeline.makeQueue<uint64_t>());
+    shards.emplace_back(retired[i]);
+  }
+  ShardRouter router(queues, retired);
+  MatchingEngine decoder;
+  // One message per batch, and the router takes in the shards' retirements
+  // before the next one.
+  auto send = [&](const std::string& line) {
+    MatchingEngine::token_t tokens;
+    OrderMsg msg{};
+    int sz = -1;
+    decoder.messageToToken(line, tokens);
+    decoder.processTokens(tokens, msg, sz);
+    router(msg);
+    router.flush();
+    for (size_t i = 0; i < kShards; ++i) {
+      while (OrderMsg* routed = queues[i]->front()) {
+        shards[i](*routed);
+        queues[i]->release();
+      }
+      shards[i].flush();
+    }
+    router.flush();
+  };
+
+  // AAPL and MSFT live on different shards.
+  send("0,1,0,10,100,AAPL");
+  send("0,1,1,3,100,MSFT");  // 1 is live on the AAPL shard: rejected
+  send("1,1");
+  EXPECT_EQ(err.str(), "Duplicate order ID: 1\n");
+  EXPECT_EQ(router.trackedOrders(), 0u);
+
+  // Filled, reduced away and modified into a fill: all forgotten, and a
+  // filled id can then be reused on the other shard.
+  for (const char* line : { "0,2,1,5,100,AAPL", "0,3,0,5,100,AAPL", "0,4,0,4,90,AAPL", "6,4,4",
+                            "0,5,0,2,90,AAPL", "0,6,1,2,95,AAPL", "5,5,2,95" }) {
+    send(line);
+  }
+  EXPECT_EQ(router.trackedOrders(), 0u);
+  send("0,2,0,3,50,MSFT");
+  EXPECT_EQ(router.trackedOrders(), 1u);
+  send("1,2");
+  EXPECT_EQ(router.trackedOrders(), 0u);
+  EXPECT_EQ(err.str(), "Duplicate order ID: 1\n");
+  EXPECT_EQ(out.str(), "2,5,100\n3,3\n3,2\n2,2,95\n3,5\n3,6\n");
+
+  logger.set_out_stream(nullptr, nullptr);
+  logger.set_enabled(true);
+}
+
 int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();